@@ -1,7 +1,9 @@
 #include "chunk.h"
 
+#include <string.h>
 
 #include "memory.h"
+#include "vm.h"
 
 void InitChunk(Chunk* chunk)
 {
@@ -9,15 +11,18 @@ void InitChunk(Chunk* chunk)
 	chunk->count = 0;
 	chunk->code = NULL;
 	chunk->lines = NULL;
+	chunk->line_count = 0;
+	chunk->line_capacity = 0;
+	chunk->max_stack = 0;
 	InitValueArray(&chunk->constants);
 }
 
 void FreeChunk(Chunk* chunk)
 {
 	FREE_ARRAY(uint8_t, chunk->code, chunk->capaciy);
-	FREE_ARRAY(int, chunk->lines, chunk->capaciy);
-	InitChunk(chunk);
+	FREE_ARRAY(LineStart, chunk->lines, chunk->line_capacity);
 	FreeValueArray(&chunk->constants);
+	InitChunk(chunk);
 }
 
 void WriteChunk(Chunk* chunk, uint8_t byte, int line)
@@ -27,16 +32,73 @@ void WriteChunk(Chunk* chunk, uint8_t byte, int line)
 		chunk->capaciy = GROW_CAPACITY(old_capacity);
 		chunk->code = GROW_ARRAY(uint8_t, chunk->code,
 			old_capacity, chunk->capaciy);
-		chunk->lines = GROW_ARRAY(int, chunk->lines,
-			old_capacity, chunk->capaciy);
 	}
 	chunk->code[chunk->count] = byte;
-	chunk->lines[chunk->count] = line;
+	AddLine(chunk, chunk->count, line);
 	chunk->count++;
 }
 
+// starts a new run when the byte at offset is on a different
+// line than the one before it.
+void AddLine(Chunk* chunk, int offset, int line)
+{
+	if (chunk->line_count > 0 &&
+		chunk->lines[chunk->line_count - 1].line == line) {
+		return;
+	}
+	if (chunk->line_count >= chunk->line_capacity) {
+		int old_capacity = chunk->line_capacity;
+		chunk->line_capacity = GROW_CAPACITY(old_capacity);
+		chunk->lines = GROW_ARRAY(LineStart, chunk->lines,
+			old_capacity, chunk->line_capacity);
+	}
+	LineStart* start = &chunk->lines[chunk->line_count++];
+	start->offset = offset;
+	start->line = line;
+}
+
+int GetLine(const Chunk* chunk, int offset)
+{
+	if (chunk->line_count == 0) return 0;
+	// the last run that starts at or before offset.
+	int low = 0;
+	int high = chunk->line_count - 1;
+	while (low < high) {
+		int mid = low + (high - low + 1) / 2;
+		if (chunk->lines[mid].offset <= offset) {
+			low = mid;
+		}
+		else {
+			high = mid - 1;
+		}
+	}
+	return chunk->lines[low].line;
+}
+
+bool IsSameConstant(Value a, Value b)
+{
+	if (IS_NUMBER(a) && IS_NUMBER(b)) {
+		double x = AS_NUMBER(a);
+		double y = AS_NUMBER(b);
+		return memcmp(&x, &y, sizeof(double)) == 0;
+	}
+	return IS_STRING(a) && IS_STRING(b) && AS_STRING(a) == AS_STRING(b);
+}
+
+int FindConstant(const Chunk* chunk, Value value)
+{
+	for (int i = 0; i < chunk->constants.count; i++) {
+		if (IsSameConstant(chunk->constants.values[i], value)) return i;
+	}
+	return -1;
+}
+
 int AddConstant(Chunk* chunk, Value value)
 {
+	// the constant may not be reachable from anywhere else yet.
+	PushStack(value);
 	WriteValueArray(&chunk->constants, value);
+	WRITE_BARRIER(value);
+	PopStack();
 	return chunk->constants.count - 1;
 }
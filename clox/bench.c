@@ -0,0 +1,446 @@
+#include "bench.h"
+
+#ifdef DEBUG_BENCHMARK
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "memory.h"
+#include "object.h"
+#include "scanner.h"
+#include "table.h"
+#include "vm.h"
+
+// each timing is the best of this many runs.
+#define BENCH_RUNS 25
+#define MB (1024.0 * 1024.0)
+// lookups timed per run of the table benchmark.
+#define TABLE_LOOKUPS (1 << 18)
+
+typedef struct {
+	char* chars;
+	size_t length;
+	size_t capacity;
+} Text;
+
+typedef struct {
+	const char* name;
+	void (*run)();
+} Benchmark;
+
+static uint64_t NowNs() {
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// xorshift64, reseeded by each generator so the input is the same
+// on every run and every build.
+static uint64_t random_state;
+
+static void SeedRandom(uint64_t seed) {
+	random_state = seed;
+}
+
+static uint32_t Random(uint32_t bound) {
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 7;
+	random_state ^= random_state << 17;
+	return (uint32_t)(random_state % bound);
+}
+
+static void Append(Text* text, const char* chars, size_t length) {
+	if (text->length + length > text->capacity) {
+		size_t capacity = text->capacity < 1024 ? 1024 : text->capacity;
+		while (text->length + length > capacity) capacity *= 2;
+		text->chars = (char*)realloc(text->chars, capacity);
+		if (text->chars == NULL) {
+			fprintf(stderr, "not enough memory for the benchmark input.\n");
+			exit(74);
+		}
+		text->capacity = capacity;
+	}
+	memcpy(text->chars + text->length, chars, length);
+	text->length += length;
+}
+
+static void AppendString(Text* text, const char* chars) {
+	Append(text, chars, strlen(chars));
+}
+
+static void AppendChar(Text* text, char c) {
+	Append(text, &c, 1);
+}
+
+static void AppendNumber(Text* text, uint32_t number) {
+	char digits[16];
+	int length = snprintf(digits, sizeof(digits), "%u", number);
+	Append(text, digits, (size_t)length);
+}
+
+// an identifier of min to max characters.
+static void AppendName(Text* text, int min, int max) {
+	static const char first[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_";
+	static const char rest[] = "abcdefghijklmnopqrstuvwxyz_0123456789";
+	int length = min + (int)Random((uint32_t)(max - min + 1));
+	AppendChar(text, first[Random(sizeof(first) - 1)]);
+	for (int i = 1; i < length; i++) {
+		AppendChar(text, rest[Random(sizeof(rest) - 1)]);
+	}
+}
+
+// words of prose, for comments and string literals.
+static void AppendWords(Text* text, int count) {
+	static const char* words[] = {
+		"the", "value", "is", "returned", "when", "a", "scanner", "reaches",
+		"end", "of", "line", "string", "token", "and", "stack", "frame",
+	};
+	for (int i = 0; i < count; i++) {
+		if (i > 0) AppendChar(text, ' ');
+		AppendString(text, words[Random(sizeof(words) / sizeof(words[0]))]);
+	}
+}
+
+// code the way it is usually written, comments and strings included.
+static void GenerateMixed(Text* text, size_t size) {
+	SeedRandom(16);
+	while (text->length < size) {
+		AppendString(text, "// ");
+		AppendWords(text, 4 + (int)Random(8));
+		AppendString(text, "\nfun ");
+		AppendName(text, 4, 12);
+		AppendString(text, "(a, b) {\n\tvar ");
+		AppendName(text, 3, 10);
+		AppendString(text, " = a + b * ");
+		AppendNumber(text, Random(1000));
+		AppendString(text, ".5;\n\tif (a > ");
+		AppendNumber(text, Random(100));
+		AppendString(text, ") print \"");
+		AppendWords(text, 2 + (int)Random(6));
+		AppendString(text, "\";\n\twhile (b < 10) b = b + 1;\n\treturn a;\n}\n\n");
+	}
+}
+
+// short tokens with no blanks between them.
+static void GenerateDense(Text* text, size_t size) {
+	static const char operators[] = "+-*/<>";
+	SeedRandom(16);
+	while (text->length < size) {
+		AppendName(text, 1, 2);
+		AppendChar(text, '=');
+		for (int i = Random(4); i >= 0; i--) {
+			AppendName(text, 1, 2);
+			AppendChar(text, operators[Random(sizeof(operators) - 1)]);
+		}
+		AppendNumber(text, Random(10));
+		AppendString(text, ";\n");
+	}
+}
+
+static void GenerateIdentifiers(Text* text, size_t size) {
+	SeedRandom(16);
+	while (text->length < size) {
+		AppendName(text, 16, 64);
+		AppendChar(text, Random(8) == 0 ? '\n' : ' ');
+	}
+}
+
+// long comments and strings, some of the strings over several lines.
+static void GenerateProse(Text* text, size_t size) {
+	SeedRandom(16);
+	while (text->length < size) {
+		AppendString(text, "// ");
+		AppendWords(text, 10 + (int)Random(20));
+		AppendString(text, "\nprint \"");
+		AppendWords(text, 10 + (int)Random(20));
+		if (Random(4) == 0) {
+			AppendChar(text, '\n');
+			AppendWords(text, 10 + (int)Random(20));
+		}
+		AppendString(text, "\";\n");
+	}
+}
+
+// the checksum covers every token, so builds that scan differently
+// print different ones.
+static uint64_t ScanText(const Text* text, long* token_count) {
+	uint64_t checksum = 0;
+	long count = 0;
+	InitScanner(text->chars, text->length);
+	for (;;) {
+		Token token = ScanToken();
+		checksum = checksum * 31 + (uint64_t)token.type * 65599 +
+			(uint64_t)token.length * 257 + (uint64_t)token.line;
+		count++;
+		if (token.type == TOKEN_EOF) break;
+	}
+	FreeScanner();
+	*token_count = count;
+	return checksum;
+}
+
+static void BenchScanner() {
+	static const struct {
+		const char* name;
+		void (*generate)(Text* text, size_t size);
+		size_t size;
+	} inputs[] = {
+		{ "mixed", GenerateMixed, 16 * 1024 * 1024 },
+		{ "dense", GenerateDense, 8 * 1024 * 1024 },
+		{ "identifiers", GenerateIdentifiers, 8 * 1024 * 1024 },
+		{ "prose", GenerateProse, 8 * 1024 * 1024 },
+	};
+	printf("%-12s %8s %10s %10s  %s\n", "input", "MB", "tokens", "MB/s", "checksum");
+	for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+		Text text = { NULL, 0, 0 };
+		inputs[i].generate(&text, inputs[i].size);
+
+		uint64_t best = UINT64_MAX;
+		uint64_t checksum = 0;
+		long tokens = 0;
+		for (int run = 0; run < BENCH_RUNS; run++) {
+			uint64_t start = NowNs();
+			checksum = ScanText(&text, &tokens);
+			uint64_t elapsed = NowNs() - start;
+			if (elapsed < best) best = elapsed;
+		}
+		printf("%-12s %8.1f %10ld %10.0f  %016llx\n", inputs[i].name,
+			text.length / MB, tokens, text.length / MB / (best / 1e9),
+			(unsigned long long)checksum);
+		free(text.chars);
+	}
+}
+
+// identifiers the way a script names things.
+static void GenerateNames(Text* text, size_t count) {
+	SeedRandom(21);
+	for (size_t i = 0; i < count; i++) {
+		AppendName(text, 2, 16);
+		AppendChar(text, '\n');
+	}
+}
+
+static void GenerateCounted(Text* text, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		AppendChar(text, 'k');
+		AppendNumber(text, (uint32_t)i);
+		AppendChar(text, '\n');
+	}
+}
+
+// the lines of generated code, as long string payloads.
+static void GenerateLines(Text* text, size_t count) {
+	GenerateMixed(text, count * 24);
+}
+
+// interns each line of text into a table of its own and prints how
+// far the probes had to go.
+static void PrintProbes(const char* name, const Text* text) {
+	Table table;
+	InitTable(&table);
+	size_t bytes = 0;
+	const char* end = text->chars + text->length;
+	for (const char* line = text->chars; line < end; ) {
+		const char* next = (const char*)memchr(line, '\n', (size_t)(end - line));
+		if (next == NULL) next = end;
+		if (next > line && TableSet(&table, CopyString(line, (int)(next - line)), NIL_VAL)) {
+			bytes += (size_t)(next - line);
+		}
+		line = next + 1;
+	}
+
+	TableStats stats;
+	GetTableStats(&table, &stats);
+	printf("%-12s %8d %8.1f %6.2f %8.3f %6d\n", name, stats.count,
+		stats.count > 0 ? (double)bytes / stats.count : 0.0,
+		stats.capacity > 0 ? (double)stats.count / stats.capacity : 0.0,
+		stats.average_probe, stats.max_probe);
+	FreeTable(&table);
+}
+
+static volatile uint32_t hash_sink;
+
+static void BenchHash() {
+#ifdef FAST_STRING_HASH
+	printf("HashString: word at a time\n");
+#else
+	printf("HashString: FNV-1a\n");
+#endif // FAST_STRING_HASH
+	// random bytes, each hash starts at a different offset in them.
+	Text bytes = { NULL, 0, 0 };
+	SeedRandom(21);
+	while (bytes.length < 1024 * 1024) AppendChar(&bytes, (char)Random(256));
+
+	static const int lengths[] = { 3, 8, 16, 64, 4096 };
+	printf("%8s %10s %10s\n", "length", "ns", "GB/s");
+	for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		int length = lengths[i];
+		int hashes = length >= 1024 ? 1 << 14 : 1 << 20;
+		size_t limit = bytes.length - (size_t)length;
+		uint64_t best = UINT64_MAX;
+		for (int run = 0; run < BENCH_RUNS; run++) {
+			uint32_t sink = 0;
+			size_t offset = 0;
+			uint64_t start = NowNs();
+			for (int n = 0; n < hashes; n++) {
+				sink ^= HashString(bytes.chars + offset, length);
+				offset += 61;
+				if (offset > limit) offset -= limit;
+			}
+			uint64_t elapsed = NowNs() - start;
+			hash_sink = sink;
+			if (elapsed < best) best = elapsed;
+		}
+		printf("%8d %10.1f %10.2f\n", length, (double)best / hashes,
+			(double)length * hashes / best);
+	}
+	free(bytes.chars);
+
+	// probes count the groups looked at, 1 is a key in its first group.
+	static const struct {
+		const char* name;
+		void (*generate)(Text* text, size_t count);
+		size_t count;
+	} corpora[] = {
+		{ "names", GenerateNames, 100000 },
+		{ "counted", GenerateCounted, 200000 },
+		{ "lines", GenerateLines, 100000 },
+	};
+	printf("\n%-12s %8s %8s %6s %8s %6s\n", "corpus", "keys", "length", "load",
+		"probe", "max");
+	for (size_t i = 0; i < sizeof(corpora) / sizeof(corpora[0]); i++) {
+		Text text = { NULL, 0, 0 };
+		corpora[i].generate(&text, corpora[i].count);
+		PrintProbes(corpora[i].name, &text);
+		free(text.chars);
+	}
+}
+
+static ObjString** NewKeys(int count) {
+	ObjString** keys = (ObjString**)malloc(sizeof(ObjString*) * count);
+	if (keys == NULL) {
+		fprintf(stderr, "not enough memory for the benchmark keys.\n");
+		exit(74);
+	}
+	return keys;
+}
+
+// count interned strings, "name_0" and on after prefix.
+static ObjString** MakeKeys(const char* prefix, int count) {
+	ObjString** keys = NewKeys(count);
+	char chars[32];
+	for (int i = 0; i < count; i++) {
+		int length = snprintf(chars, sizeof(chars), "%s_%d", prefix, i);
+		keys[i] = CopyString(chars, length);
+	}
+	return keys;
+}
+
+static void Shuffle(ObjString** keys, int count) {
+	for (int i = count - 1; i > 0; i--) {
+		int j = (int)Random((uint32_t)i + 1);
+		ObjString* key = keys[i];
+		keys[i] = keys[j];
+		keys[j] = key;
+	}
+}
+
+// the best time of one lookup, cycling through keys. TableGet() when
+// find is false, TableFindString() when it is true.
+static double TimeLookups(Table* table, ObjString** keys, int count, bool find,
+	int expect) {
+	uint64_t best = UINT64_MAX;
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		int found = 0;
+		int i = 0;
+		Value value;
+		uint64_t start = NowNs();
+		for (int n = 0; n < TABLE_LOOKUPS; n++) {
+			ObjString* key = keys[i];
+			if (find) {
+				found += TableFindString(table, key->str, key->length, key->hash) != NULL;
+			}
+			else {
+				found += TableGet(table, key, &value);
+			}
+			if (++i == count) i = 0;
+		}
+		uint64_t elapsed = NowNs() - start;
+		if (elapsed < best) best = elapsed;
+		if (found != expect) {
+			fprintf(stderr, "table lookups found %d keys, not %d.\n", found, expect);
+			exit(70);
+		}
+	}
+	return (double)best / TABLE_LOOKUPS;
+}
+
+// lookups in tables filled to several loads. a small table stays in
+// the cache, a large one does not. misses look up keys that are
+// interned but not in the table.
+static void BenchTable() {
+	static const int capacities[] = { 4096, 1 << 20 };
+	static const double loads[] = { 0.45, 0.6, 0.75, 0.87 };
+	SeedRandom(22);
+	printf("%8s %8s %6s %9s %9s %9s %9s  (ns)\n", "slots", "keys", "load",
+		"get hit", "get miss", "find hit", "find miss");
+	for (size_t i = 0; i < sizeof(capacities) / sizeof(capacities[0]); i++) {
+		int most = (int)(capacities[i] * loads[sizeof(loads) / sizeof(loads[0]) - 1]);
+		ObjString** keys = MakeKeys("name", most);
+		ObjString** misses = MakeKeys("miss", most);
+		ObjString** order = NewKeys(most);
+		Shuffle(misses, most);
+
+		for (size_t j = 0; j < sizeof(loads) / sizeof(loads[0]); j++) {
+			int count = (int)(capacities[i] * loads[j]);
+			Table table;
+			InitTable(&table);
+			for (int k = 0; k < count; k++) {
+				TableSet(&table, keys[k], NIL_VAL);
+			}
+			memcpy(order, keys, sizeof(ObjString*) * count);
+			Shuffle(order, count);
+
+			TableStats stats;
+			GetTableStats(&table, &stats);
+			printf("%8d %8d %6.2f %9.1f %9.1f %9.1f %9.1f\n", stats.capacity,
+				stats.count, (double)stats.count / stats.capacity,
+				TimeLookups(&table, order, count, false, TABLE_LOOKUPS),
+				TimeLookups(&table, misses, count, false, 0),
+				TimeLookups(&table, order, count, true, TABLE_LOOKUPS),
+				TimeLookups(&table, misses, count, true, 0));
+			FreeTable(&table);
+		}
+		free(keys);
+		free(misses);
+		free(order);
+	}
+}
+
+static const Benchmark benchmarks[] = {
+	{ "scanner", BenchScanner },
+	{ "hash", BenchHash },
+	{ "table", BenchTable },
+};
+
+bool RunBenchmark(const char* name)
+{
+	// the benchmarks hold objects no root reaches, so the collector
+	// stays off until the VM is freed.
+	vm.next_gc = SIZE_MAX;
+	size_t count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+	for (size_t i = 0; i < count; i++) {
+		if (strcmp(name, benchmarks[i].name) == 0) {
+			benchmarks[i].run();
+			return true;
+		}
+	}
+	fprintf(stderr, "unknown benchmark '%s', try:", name);
+	for (size_t i = 0; i < count; i++) {
+		fprintf(stderr, " %s", benchmarks[i].name);
+	}
+	fprintf(stderr, "\n");
+	return false;
+}
+#endif // DEBUG_BENCHMARK
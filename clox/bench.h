@@ -0,0 +1,12 @@
+#ifndef CLOX_BENCH_H
+#define CLOX_BENCH_H
+
+#include "common.h"
+
+#ifdef DEBUG_BENCHMARK
+// runs the named benchmark on generated input and prints its numbers.
+// an unknown name lists the ones there are and returns false.
+bool RunBenchmark(const char* name);
+#endif // DEBUG_BENCHMARK
+
+#endif // !CLOX_BENCH_H
@@ -0,0 +1,474 @@
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "file.h"
+#include "memory.h"
+#include "optimizer.h"
+#include "table.h"
+#include "vm.h"
+
+// "LOXC" in file order, a cache written with the other byte order
+// fails this check.
+#define CACHE_MAGIC 0x43584f4c
+// bump whenever the opcodes or the layout below change.
+#define CACHE_VERSION 3
+
+// a cache file is laid out as:
+//   CacheHeader
+//   string_count strings, each a uint32_t length and its characters
+//   global_count string indices, the names of the global slots in order
+//   the script function, as written by WriteFunction()
+// payload_hash covers everything after the header.
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t string_count;
+	uint32_t global_count;
+	uint64_t source_hash;
+	uint64_t payload_hash;
+	int64_t source_mtime;
+	uint64_t source_size;
+} CacheHeader;
+
+typedef enum {
+	CONSTANT_NUMBER,
+	CONSTANT_STRING,
+	CONSTANT_FUNCTION,
+} ConstantTag;
+
+#define NO_NAME UINT32_MAX
+
+#define HASH_SEED 14695981039346656037u
+
+// 64-bit FNV-1a, carrying on from hash.
+static uint64_t HashBytes(uint64_t hash, const void* bytes, size_t length) {
+	const uint8_t* data = (const uint8_t*)bytes;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= data[i];
+		hash *= 1099511628211u;
+	}
+	return hash;
+}
+
+static bool StatSource(const char* path, CacheHeader* header) {
+	struct stat info;
+	if (stat(path, &info) != 0) return false;
+	header->source_mtime = (int64_t)info.st_mtime;
+	header->source_size = (uint64_t)info.st_size;
+	return true;
+}
+
+// only "*.lox" scripts are cached, a cache next to any other file
+// could replace one that is not ours.
+static char* CachePath(const char* path, const char* suffix) {
+	size_t length = strlen(path);
+	size_t suffix_length = strlen(suffix);
+	if (length < 4 || strcmp(path + length - 4, ".lox") != 0) return NULL;
+	char* cache_path = (char*)malloc(length + suffix_length + 1);
+	if (cache_path == NULL) return NULL;
+	memcpy(cache_path, path, length);
+	memcpy(cache_path + length, suffix, suffix_length + 1);
+	return cache_path;
+}
+
+typedef struct {
+	FILE* file;
+	// lazy functions point into the source, they are written as offsets.
+	const char* source;
+	// each string the functions refer to and its index in the file.
+	Table string_index;
+	ValueArray strings;
+	uint64_t hash;
+	bool ok;
+} Writer;
+
+static void CollectString(Writer* writer, ObjString* string) {
+	Value index;
+	if (string == NULL || TableGet(&writer->string_index, string, &index)) return;
+	TableSet(&writer->string_index, string, NUMBER_VAL(writer->strings.count));
+	WriteValueArray(&writer->strings, OBJ_VAL(string));
+}
+
+static void CollectStrings(Writer* writer, ObjFunction* function) {
+	CollectString(writer, function->name);
+	ValueArray* constants = &function->chunk.constants;
+	for (int i = 0; i < constants->count; i++) {
+		if (IS_STRING(constants->values[i])) {
+			CollectString(writer, AS_STRING(constants->values[i]));
+		}
+		else if (IS_FUNCTION(constants->values[i])) {
+			CollectStrings(writer, AS_FUNCTION(constants->values[i]));
+		}
+	}
+}
+
+static uint32_t StringIndex(Writer* writer, ObjString* string) {
+	Value index;
+	if (string == NULL || !TableGet(&writer->string_index, string, &index)) {
+		return NO_NAME;
+	}
+	return (uint32_t)AS_NUMBER(index);
+}
+
+static void WriteBytes(Writer* writer, const void* bytes, size_t size) {
+	if (size > 0 && fwrite(bytes, size, 1, writer->file) != 1) {
+		writer->ok = false;
+	}
+	writer->hash = HashBytes(writer->hash, bytes, size);
+}
+
+static void WriteU32(Writer* writer, uint32_t value) {
+	WriteBytes(writer, &value, sizeof(value));
+}
+
+static void WriteU64(Writer* writer, uint64_t value) {
+	WriteBytes(writer, &value, sizeof(value));
+}
+
+static void WriteLazyFunction(Writer* writer, LazyFunction* lazy) {
+	WriteU64(writer, (uint64_t)(lazy->start - writer->source));
+	WriteU32(writer, (uint32_t)lazy->line);
+	WriteU32(writer, (uint32_t)lazy->capture_count);
+	for (int i = 0; i < lazy->capture_count; i++) {
+		WriteU64(writer, (uint64_t)(lazy->captures[i].start - writer->source));
+		WriteU32(writer, (uint32_t)lazy->captures[i].length);
+	}
+}
+
+// arity, upvalue count, name, then either a lazy body or max stack,
+// code, line runs and each constant behind its ConstantTag. a nested
+// function is written in place of its constant.
+static void WriteFunction(Writer* writer, ObjFunction* function) {
+	Chunk* chunk = &function->chunk;
+	WriteU32(writer, (uint32_t)function->arity);
+	WriteU32(writer, (uint32_t)function->upvalue_count);
+	WriteU32(writer, StringIndex(writer, function->name));
+	WriteU32(writer, function->lazy != NULL);
+	if (function->lazy != NULL) {
+		WriteLazyFunction(writer, function->lazy);
+		return;
+	}
+	WriteU32(writer, (uint32_t)chunk->max_stack);
+	WriteU32(writer, (uint32_t)chunk->count);
+	WriteBytes(writer, chunk->code, chunk->count);
+	WriteU32(writer, (uint32_t)chunk->line_count);
+	WriteBytes(writer, chunk->lines, sizeof(LineStart) * chunk->line_count);
+
+	WriteU32(writer, (uint32_t)chunk->constants.count);
+	for (int i = 0; i < chunk->constants.count; i++) {
+		Value constant = chunk->constants.values[i];
+		uint8_t tag;
+		if (IS_NUMBER(constant)) {
+			tag = CONSTANT_NUMBER;
+			double number = AS_NUMBER(constant);
+			WriteBytes(writer, &tag, 1);
+			WriteBytes(writer, &number, sizeof(number));
+		}
+		else if (IS_STRING(constant)) {
+			tag = CONSTANT_STRING;
+			WriteBytes(writer, &tag, 1);
+			WriteU32(writer, StringIndex(writer, AS_STRING(constant)));
+		}
+		else if (IS_FUNCTION(constant)) {
+			tag = CONSTANT_FUNCTION;
+			WriteBytes(writer, &tag, 1);
+			WriteFunction(writer, AS_FUNCTION(constant));
+		}
+		else {
+			writer->ok = false;
+		}
+	}
+}
+
+void SaveCachedFunction(const char* path, const char* source, size_t length, ObjFunction* function)
+{
+	CacheHeader header;
+	if (!StatSource(path, &header)) return;
+	char* cache_path = CachePath(path, "c");
+	char* temp_path = CachePath(path, "c.tmp");
+	if (cache_path == NULL || temp_path == NULL) {
+		free(cache_path);
+		free(temp_path);
+		return;
+	}
+
+	Writer writer;
+	writer.source = source;
+	writer.hash = HASH_SEED;
+	writer.ok = true;
+	InitTable(&writer.string_index);
+	InitValueArray(&writer.strings);
+	// the function is not rooted yet and the tables allocate.
+	PushStack(OBJ_VAL(function));
+	for (int i = 0; i < vm.global_names.count; i++) {
+		CollectString(&writer, AS_STRING(vm.global_names.values[i]));
+	}
+	CollectStrings(&writer, function);
+
+	header.magic = CACHE_MAGIC;
+	header.version = CACHE_VERSION;
+	header.string_count = (uint32_t)writer.strings.count;
+	header.global_count = (uint32_t)vm.global_names.count;
+	header.source_hash = HashBytes(HASH_SEED, source, length);
+	header.payload_hash = 0;
+
+	// written aside and renamed, so a reader never maps a half
+	// written cache.
+	writer.file = fopen(temp_path, "wb");
+	if (writer.file != NULL) {
+		WriteBytes(&writer, &header, sizeof(header));
+		writer.hash = HASH_SEED;
+		for (int i = 0; i < writer.strings.count; i++) {
+			ObjString* string = AS_STRING(writer.strings.values[i]);
+			WriteU32(&writer, (uint32_t)string->length);
+			WriteBytes(&writer, string->str, string->length);
+		}
+		for (int i = 0; i < vm.global_names.count; i++) {
+			WriteU32(&writer, StringIndex(&writer, AS_STRING(vm.global_names.values[i])));
+		}
+		WriteFunction(&writer, function);
+		// the header goes in again now the payload is known.
+		header.payload_hash = writer.hash;
+		if (fseek(writer.file, 0, SEEK_SET) != 0) writer.ok = false;
+		WriteBytes(&writer, &header, sizeof(header));
+
+		bool ok = fclose(writer.file) == 0 && writer.ok;
+		if (ok) {
+			remove(cache_path);
+			ok = rename(temp_path, cache_path) == 0;
+		}
+		if (!ok) remove(temp_path);
+	}
+
+	PopStack();
+	FreeTable(&writer.string_index);
+	FreeValueArray(&writer.strings);
+	free(cache_path);
+	free(temp_path);
+}
+
+typedef struct {
+	const char* source;
+	size_t source_length;
+	const uint8_t* cursor;
+	const uint8_t* end;
+	// the strings stay in the mapped file until a function needs them.
+	const char** string_chars;
+	uint32_t* string_lengths;
+	uint32_t string_count;
+	bool ok;
+} Reader;
+
+static const uint8_t* ReadBytes(Reader* reader, size_t count, size_t size) {
+	size_t left = (size_t)(reader->end - reader->cursor);
+	if (!reader->ok || (size > 0 && count > left / size)) {
+		reader->ok = false;
+		return NULL;
+	}
+	const uint8_t* bytes = reader->cursor;
+	reader->cursor += count * size;
+	return bytes;
+}
+
+static uint32_t ReadU32(Reader* reader) {
+	uint32_t value = 0;
+	const uint8_t* bytes = ReadBytes(reader, 1, sizeof(value));
+	if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+	return value;
+}
+
+static uint64_t ReadU64(Reader* reader) {
+	uint64_t value = 0;
+	const uint8_t* bytes = ReadBytes(reader, 1, sizeof(value));
+	if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+	return value;
+}
+
+static ObjString* InternString(Reader* reader, uint32_t index) {
+	if (!reader->ok || index >= reader->string_count) {
+		reader->ok = false;
+		return NULL;
+	}
+	return CopyString(reader->string_chars[index], (int)reader->string_lengths[index]);
+}
+
+static ObjString* ReadString(Reader* reader) {
+	return InternString(reader, ReadU32(reader));
+}
+
+static bool ReadStrings(Reader* reader, uint32_t count) {
+	if (count > (size_t)(reader->end - reader->cursor) / sizeof(uint32_t)) return false;
+	reader->string_chars = (const char**)malloc(sizeof(const char*) * (count + 1));
+	reader->string_lengths = (uint32_t*)malloc(sizeof(uint32_t) * (count + 1));
+	if (reader->string_chars == NULL || reader->string_lengths == NULL) return false;
+	for (uint32_t i = 0; i < count && reader->ok; i++) {
+		reader->string_lengths[i] = ReadU32(reader);
+		reader->string_chars[i] = (const char*)ReadBytes(reader, reader->string_lengths[i], 1);
+	}
+	reader->string_count = count;
+	return reader->ok;
+}
+
+// the compiled code refers to globals by slot, the slots of this VM
+// must line up with the ones the cache was compiled against.
+static bool ReadGlobals(Reader* reader, uint32_t count) {
+	for (uint32_t i = 0; i < count; i++) {
+		ObjString* name = ReadString(reader);
+		if (name == NULL || ResolveGlobal(name) != (int)i) return false;
+	}
+	return true;
+}
+
+static bool ReadLazyFunction(Reader* reader, ObjFunction* function) {
+#ifndef LAZY_COMPILE
+	// written by a build that compiles lazily, this one cannot.
+	return reader->ok = false;
+#endif // !LAZY_COMPILE
+	uint64_t start = ReadU64(reader);
+	int line = (int)ReadU32(reader);
+	uint32_t capture_count = ReadU32(reader);
+	size_t capture_size = sizeof(uint64_t) + sizeof(uint32_t);
+	if (!reader->ok || function->name == NULL || start > reader->source_length ||
+		capture_count != (uint32_t)function->upvalue_count ||
+		capture_count > (size_t)(reader->end - reader->cursor) / capture_size) {
+		return reader->ok = false;
+	}
+
+	LazyFunction* lazy = ALLOCATE(LazyFunction, 1);
+	lazy->start = reader->source + start;
+	lazy->end = reader->source + reader->source_length;
+	lazy->line = line;
+	lazy->captures = ALLOCATE(LazyCapture, capture_count);
+	lazy->capture_count = (int)capture_count;
+	function->lazy = lazy;
+	for (uint32_t i = 0; i < capture_count; i++) {
+		uint64_t offset = ReadU64(reader);
+		uint32_t length = ReadU32(reader);
+		if (!reader->ok || offset > reader->source_length ||
+			length > reader->source_length - offset) {
+			return reader->ok = false;
+		}
+		lazy->captures[i].start = reader->source + offset;
+		lazy->captures[i].length = (int)length;
+	}
+	return true;
+}
+
+static bool ReadFunction(Reader* reader, ObjFunction* function) {
+	Chunk* chunk = &function->chunk;
+	uint32_t arity = ReadU32(reader);
+	uint32_t upvalue_count = ReadU32(reader);
+	uint32_t name = ReadU32(reader);
+	if (arity > UINT8_MAX || upvalue_count > UINT8_COUNT) return reader->ok = false;
+	function->arity = (int)arity;
+	function->upvalue_count = (int)upvalue_count;
+	if (name != NO_NAME) function->name = InternString(reader, name);
+	if (ReadU32(reader) != 0) return ReadLazyFunction(reader, function);
+	chunk->max_stack = (int)ReadU32(reader);
+
+	uint32_t count = ReadU32(reader);
+	const uint8_t* code = ReadBytes(reader, count, 1);
+	if (code == NULL) return false;
+	chunk->code = ALLOCATE(uint8_t, count);
+	memcpy(chunk->code, code, count);
+	chunk->count = (int)count;
+	chunk->capaciy = (int)count;
+
+	uint32_t line_count = ReadU32(reader);
+	const uint8_t* lines = ReadBytes(reader, line_count, sizeof(LineStart));
+	if (lines == NULL) return false;
+	chunk->lines = ALLOCATE(LineStart, line_count);
+	memcpy(chunk->lines, lines, sizeof(LineStart) * line_count);
+	chunk->line_count = (int)line_count;
+	chunk->line_capacity = (int)line_count;
+
+	uint32_t constant_count = ReadU32(reader);
+	for (uint32_t i = 0; i < constant_count && reader->ok; i++) {
+		const uint8_t* tag = ReadBytes(reader, 1, 1);
+		if (tag == NULL) break;
+		switch (*tag) {
+		case CONSTANT_NUMBER: {
+			double number;
+			const uint8_t* bytes = ReadBytes(reader, 1, sizeof(number));
+			if (bytes == NULL) break;
+			memcpy(&number, bytes, sizeof(number));
+			AddConstant(chunk, NUMBER_VAL(number));
+			break;
+		}
+		case CONSTANT_STRING: {
+			ObjString* string = ReadString(reader);
+			if (string != NULL) AddConstant(chunk, OBJ_VAL(string));
+			break;
+		}
+		case CONSTANT_FUNCTION: {
+			// added before it is filled in so the collector reaches it.
+			ObjFunction* nested = NewFunction();
+			AddConstant(chunk, OBJ_VAL(nested));
+			ReadFunction(reader, nested);
+			break;
+		}
+		default:
+			reader->ok = false;
+			break;
+		}
+	}
+	// the hash only catches damage, a cache written by hand must
+	// still be safe to run.
+	if (reader->ok && !VerifyChunk(chunk, function->arity,
+		function->upvalue_count, vm.global_values.count)) {
+		reader->ok = false;
+	}
+	return reader->ok;
+}
+
+ObjFunction* LoadCachedFunction(const char* path, const char* source, size_t length)
+{
+	CacheHeader source_info;
+	if (!StatSource(path, &source_info)) return NULL;
+	char* cache_path = CachePath(path, "c");
+	MappedFile map;
+	bool mapped = cache_path != NULL && MapFile(cache_path, &map);
+	free(cache_path);
+	if (!mapped) return NULL;
+
+	Reader reader;
+	reader.source = source;
+	reader.source_length = length;
+	reader.cursor = (const uint8_t*)map.data;
+	reader.end = reader.cursor + map.size;
+	reader.string_chars = NULL;
+	reader.string_lengths = NULL;
+	reader.string_count = 0;
+	reader.ok = true;
+
+	ObjFunction* function = NULL;
+	CacheHeader header;
+	const uint8_t* bytes = ReadBytes(&reader, 1, sizeof(header));
+	if (bytes != NULL) {
+		memcpy(&header, bytes, sizeof(header));
+	}
+	if (bytes != NULL &&
+		header.magic == CACHE_MAGIC &&
+		header.version == CACHE_VERSION &&
+		header.source_mtime == source_info.source_mtime &&
+		header.source_size == source_info.source_size &&
+		header.source_hash == HashBytes(HASH_SEED, source, length) &&
+		header.payload_hash == HashBytes(HASH_SEED, reader.cursor,
+			(size_t)(reader.end - reader.cursor)) &&
+		ReadStrings(&reader, header.string_count) &&
+		ReadGlobals(&reader, header.global_count)) {
+		function = NewFunction();
+		PushStack(OBJ_VAL(function));
+		if (!ReadFunction(&reader, function)) function = NULL;
+		PopStack();
+	}
+
+	free(reader.string_chars);
+	free(reader.string_lengths);
+	UnmapFile(&map);
+	return function;
+}
@@ -0,0 +1,14 @@
+#ifndef CLOX_CACHE_H
+#define CLOX_CACHE_H
+
+#include "object.h"
+
+// a compiled script is cached next to its source, "test.lox" is
+// cached in "test.loxc", scripts not named "*.lox" are not cached.
+// loading returns NULL when there is no cache, it does not match the
+// source or it is damaged.
+ObjFunction* LoadCachedFunction(const char* path, const char* source, size_t length);
+void SaveCachedFunction(const char* path, const char* source, size_t length,
+	ObjFunction* function);
+
+#endif // !CLOX_CACHE_H
@@ -12,12 +12,15 @@ typedef enum {
 	OP_PRINT,
 	OP_RETURN,
 	OP_CALL,
+	OP_TAIL_CALL,
 	OP_CLOSURE,
 	OP_CLOSE_UPVALUE,
 	OP_LOOP,
 	OP_JUMP,
 	OP_JUMP_IF_FALSE,
+	OP_JUMP_IF_TRUE,
 	OP_POP,
+	OP_POPN,
 	OP_DEFINE_GLOBAL,
 	OP_GET_LOCAL,
 	OP_SET_LOCAL,
@@ -34,19 +37,52 @@ typedef enum {
 	OP_SUBTRACT,
 	OP_MULTIPLY,
 	OP_DIVIDE,
+	// superinstructions, only emitted by OptimizeChunk().
+	OP_ADD_CONSTANT,
+	OP_SUBTRACT_CONSTANT,
+	OP_LESS_CONSTANT,
+	OP_SET_LOCAL_POP,
+	OP_ADD_LOCALS,
+	OP_JUMP_IF_LESS,
+	OP_JUMP_IF_NOT_LESS,
+	OP_JUMP_IF_GREATER,
+	OP_JUMP_IF_NOT_GREATER,
+	OP_JUMP_IF_EQUAL,
+	OP_JUMP_IF_NOT_EQUAL,
+	OP_POP_JUMP_IF_FALSE,
+	OP_POP_JUMP_IF_TRUE,
 } OpCode;
 
+// the bytes from offset up to the next run came from line.
+typedef struct {
+	int offset;
+	int line;
+} LineStart;
+
 typedef struct {
 	int count;
 	int capaciy;
 	uint8_t* code;
-	int* lines;
+	LineStart* lines;
+	int line_count;
+	int line_capacity;
 	ValueArray	constants;
+	// how far the stack grows above the function's arguments,
+	// computed by OptimizeChunk().
+	int max_stack;
 } Chunk;
 
 void InitChunk(Chunk* chunk);
 void FreeChunk(Chunk* chunk);
 void WriteChunk(Chunk* chunk, uint8_t byte, int line);
 int AddConstant(Chunk* chunk, Value value);
+// numbers are the same bit for bit, so 0 and -0 stay apart, strings
+// are the same object, which interning makes the same as equal.
+// other values are never shared.
+bool IsSameConstant(Value a, Value b);
+// the index of a constant the same as value, -1 if there is none.
+int FindConstant(const Chunk* chunk, Value value);
+void AddLine(Chunk* chunk, int offset, int line);
+int GetLine(const Chunk* chunk, int offset);
 
 #endif // !CLOX_CHUNK_H
@@ -7,9 +7,28 @@
 
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
+#define DEBUG_STRESS_GC
+#define DEBUG_LOG_GC
+#define DEBUG_PROFILE_OPCODES
+#define DEBUG_TABLE_STATS
+#define DEBUG_BENCHMARK
+#define GC_INCREMENTAL
+#define NAN_BOXING
+#define BYTECODE_CACHE
+#define LAZY_COMPILE
+#define FAST_STRING_HASH
+// labels-as-values is a GNU extension, other compilers use the switch.
+#if defined(__GNUC__) || defined(__clang__)
+#define COMPUTED_GOTO
+#endif
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 #endif // !CLOX_COMMON_H
 
 #undef DEBUG_PRINT_CODE
 #undef DEBUG_TRACE_EXECUTION
+#undef DEBUG_STRESS_GC
+#undef DEBUG_LOG_GC
+#undef DEBUG_PROFILE_OPCODES
+#undef DEBUG_TABLE_STATS
+#undef DEBUG_BENCHMARK
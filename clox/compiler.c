@@ -5,7 +5,9 @@
 #include <string.h>
 
 #include "scanner.h"
+#include "memory.h"
 #include "object.h"
+#include "optimizer.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -17,6 +19,13 @@ typedef struct {
 	Token current;
 	bool had_error;
 	bool panic_mode;
+	// the end of a source that outlives the compiled code, function
+	// bodies are then left to compile on their first call. NULL to
+	// compile them right away.
+	const char* lazy_end;
+	// set while a skipped body is parsed for errors and upvalues,
+	// nothing is emitted.
+	bool syntax_only;
 } Parser;
 
 typedef enum {
@@ -48,11 +57,16 @@ typedef struct {
 typedef struct {
 	uint8_t index;
 	bool is_local;
+	// the variable's name, a skipped body records its captures by name.
+	Token name;
 } Upvalue;
 typedef enum {
 	TYPE_FUNCTION,
 	TYPE_SCRIPT,
 } FunctionType;
+// twice the most constants a chunk can address keeps the index at
+// most half full.
+#define CONSTANT_SLOTS (UINT8_COUNT * 2)
 typedef struct Compiler {
 	struct Compiler* enclosing;
 	ObjFunction* function;
@@ -61,6 +75,15 @@ typedef struct Compiler {
 	int local_count;
 	Upvalue upvalues[UINT8_COUNT];
 	int scope_depth;
+	// offset just past the last OP_CALL, a return whose value ends
+	// there can become a tail call.
+	int last_call_end;
+	// set when compiling a lazy body, its upvalues were resolved when
+	// it was skipped.
+	LazyFunction* lazy;
+	// open addressed index of the number and string constants in the
+	// chunk, so a repeated literal reuses its slot. -1 is empty.
+	int16_t constant_slots[CONSTANT_SLOTS];
 } Compiler;
 
 Parser parser;
@@ -173,6 +196,7 @@ static void Consume(TokenType type, const char* message) {
 	ErrorAtCurrent(message);
 }
 static void EmitByte(uint8_t byte) {
+	if (parser.syntax_only) return;
 	WriteChunk(CurrentChunk(), byte, parser.previous.line);
 }
 static void EmitBytes(uint8_t byte1, uint8_t byte2) {
@@ -183,12 +207,36 @@ static void EmitReturn() {
 	EmitByte(OP_NIL);
 	EmitByte(OP_RETURN);
 }
+static uint32_t HashConstant(Value value) {
+	if (IS_STRING(value)) return AS_STRING(value)->hash;
+
+	double number = AS_NUMBER(value);
+	uint64_t bits;
+	memcpy(&bits, &number, sizeof(bits));
+	return (uint32_t)((bits * 0x9E3779B97F4A7C15u) >> 32);
+}
 static uint8_t MakeConstant(Value value) {
-	int index = AddConstant(CurrentChunk(), value);
+	if (parser.syntax_only) return 0;
+	Chunk* chunk = CurrentChunk();
+	int16_t* slot = NULL;
+	if (IS_NUMBER(value) || IS_STRING(value)) {
+		uint32_t index = HashConstant(value) & (CONSTANT_SLOTS - 1);
+		for (;;) {
+			slot = &current->constant_slots[index];
+			if (*slot == -1) break;
+			if (IsSameConstant(chunk->constants.values[*slot], value)) {
+				return (uint8_t)*slot;
+			}
+			index = (index + 1) & (CONSTANT_SLOTS - 1);
+		}
+	}
+
+	int index = AddConstant(chunk, value);
 	if (index > UINT8_MAX) {
 		Error("too many constant in one chunk.");
 		return 0;
 	}
+	if (slot != NULL) *slot = (int16_t)index;
 	return (uint8_t)index;
 }
 static void EmitConstant(Value value) {
@@ -250,9 +298,53 @@ uint8_t ArgumentList() {
 static void Call(bool can_assign) {
 	uint8_t arg_count = ArgumentList();
 	EmitBytes(OP_CALL, arg_count);
+	current->last_call_end = CurrentChunk()->count;
+}
+// a literal with at most 15 significant digits has an exact double
+// mantissa, and so does every power of ten up to 1e22. one division
+// of two exact values is correctly rounded, which is what strtod
+// would return. anything longer is left to strtod.
+static bool ParseNumberFast(const char* start, int length, double* value) {
+	static const double powers_of_ten[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+	};
+	uint64_t mantissa = 0;
+	int significant = 0;
+	int fraction = -1;
+	for (int i = 0; i < length; i++) {
+		char c = start[i];
+		if (c == '.') {
+			fraction = 0;
+			continue;
+		}
+		if (mantissa != 0 || c != '0') significant++;
+		mantissa = mantissa * 10 + (uint64_t)(c - '0');
+		if (fraction >= 0) fraction++;
+	}
+	if (fraction < 0) fraction = 0;
+	if (significant > 15 || fraction > 22) return false;
+
+	*value = (double)mantissa / powers_of_ten[fraction];
+	return true;
 }
 static void Number(bool can_assign) {
-	double value = strtod(parser.previous.start, NULL);
+	if (parser.syntax_only) return;
+	double value;
+	if (ParseNumberFast(parser.previous.start, parser.previous.length, &value)) {
+		EmitConstant(NUMBER_VAL(value));
+		return;
+	}
+
+	// the token is not NUL terminated, a mapped source may end right
+	// after it.
+	char buffer[64];
+	int length = parser.previous.length;
+	char* digits = length < (int)sizeof(buffer) ? buffer : (char*)malloc(length + 1);
+	memcpy(digits, parser.previous.start, length);
+	digits[length] = '\0';
+	value = strtod(digits, NULL);
+	if (digits != buffer) free(digits);
 	EmitConstant(NUMBER_VAL(value));
 }
 static void And(bool can_assign) {
@@ -272,6 +364,7 @@ static void Or(bool can_assign) {
 	PatchJump(end_jump);
 }
 static void String(bool can_assign) {
+	if (parser.syntax_only) return;
 	EmitConstant(OBJ_VAL(CopyString(parser.previous.start + 1, parser.previous.length - 2)));
 }
 static void Unary(bool can_assign) {
@@ -301,8 +394,18 @@ static void Binary(bool can_assign) {
 	default: return;  // unreachable
 	}
 }
-static uint8_t IndentifierConstant(Token* name) {
-	return MakeConstant(OBJ_VAL(CopyString(name->start, name->length)));
+static uint16_t GlobalSlot(Token* name) {
+	if (parser.syntax_only) return 0;
+	int slot = ResolveGlobal(CopyString(name->start, name->length));
+	if (slot > UINT16_MAX) {
+		Error("too many global variables.");
+		return 0;
+	}
+	return (uint16_t)slot;
+}
+static void EmitGlobal(uint8_t op_code, uint16_t slot) {
+	EmitByte(op_code);
+	EmitBytes((slot >> 8) & 0xff, slot & 0xff);
 }
 static int ResolveLocal(Compiler* compiler, const Token* name) {
 	for (int i = compiler->local_count - 1; i >= 0; i--) {
@@ -316,7 +419,7 @@ static int ResolveLocal(Compiler* compiler, const Token* name) {
 	}
 	return -1;
 }
-static int AddUpvalue(Compiler* compiler, uint8_t index, bool is_local) {
+static int AddUpvalue(Compiler* compiler, const Token* name, uint8_t index, bool is_local) {
 	int upvalue_count = compiler->function->upvalue_count;
 	for (int i = 0; i < upvalue_count; i++) {
 		Upvalue* upvalue = &compiler->upvalues[i];
@@ -331,18 +434,30 @@ static int AddUpvalue(Compiler* compiler, uint8_t index, bool is_local) {
 
 	compiler->upvalues[upvalue_count].index = index;
 	compiler->upvalues[upvalue_count].is_local = is_local;
+	compiler->upvalues[upvalue_count].name = *name;
 	return compiler->function->upvalue_count++;
 }
+static int ResolveCapture(Compiler* compiler, const Token* name) {
+	if (compiler->lazy == NULL) return -1;
+	for (int i = 0; i < compiler->lazy->capture_count; i++) {
+		LazyCapture* capture = &compiler->lazy->captures[i];
+		if (capture->length == name->length &&
+			memcmp(capture->start, name->start, name->length) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
 static int ResolveUpvalue(Compiler* compiler, const Token* name) {
-	if (compiler->enclosing == NULL) return -1;
+	if (compiler->enclosing == NULL) return ResolveCapture(compiler, name);
 	int local = ResolveLocal(compiler->enclosing, name);
 	if (local != -1) {
 		compiler->enclosing->locals[local].is_captured = true;
-		return AddUpvalue(compiler, (uint8_t)local, true);
+		return AddUpvalue(compiler, name, (uint8_t)local, true);
 	}
 	int upvalue = ResolveUpvalue(compiler->enclosing, name);
 	if (upvalue != -1) {
-		return AddUpvalue(compiler, upvalue, false);
+		return AddUpvalue(compiler, name, upvalue, false);
 	}
 	return -1;
 }
@@ -358,9 +473,15 @@ static void NamedVariable(Token name, bool can_assign) {
 		set_op = OP_SET_UPVALUE;
 	}
 	else {
-		index = IndentifierConstant(&name);
-		get_op = OP_GET_GLOBAL;
-		set_op = OP_SET_GLOBAL;
+		uint16_t slot = GlobalSlot(&name);
+		if (can_assign && Match(TOKEN_EQUAL)) {
+			Expression();
+			EmitGlobal(OP_SET_GLOBAL, slot);
+		}
+		else {
+			EmitGlobal(OP_GET_GLOBAL, slot);
+		}
+		return;
 	}
 	if (can_assign && Match(TOKEN_EQUAL)) {
 		Expression();
@@ -421,6 +542,7 @@ static int EmitJump(uint8_t op_code) {
 	return CurrentChunk()->count - 2;
 }
 static void PatchJump(int offset) {
+	if (parser.syntax_only) return;
 	// -2 is adjust for bytecode for the jump offset itself.
 	int jump = CurrentChunk()->count - offset - 2;
 	if (jump > UINT16_MAX) {
@@ -466,6 +588,13 @@ static void ReturnStatement() {
 	else {
 		Expression();
 		Consume(TOKEN_SEMICOLON, "expect ';' after return value.");
+		// the OP_RETURN stays behind the tail call: natives return
+		// to it, and so do paths that jump past the call, as in
+		// `return a or f();`.
+		if (!parser.syntax_only &&
+			current->last_call_end == CurrentChunk()->count) {
+			CurrentChunk()->code[CurrentChunk()->count - 2] = OP_TAIL_CALL;
+		}
 		EmitByte(OP_RETURN);
 	}
 }
@@ -602,7 +731,7 @@ static void DeclareVariable() {
 	}
 	AddLocal(name);
 }
-static uint8_t ParseVariable(const char* error_message) {
+static uint16_t ParseVariable(const char* error_message) {
 	Consume(TOKEN_IDENTIFIER, error_message);
 	
 	DeclareVariable();
@@ -610,7 +739,7 @@ static uint8_t ParseVariable(const char* error_message) {
 		return 0;
 	}
 
-	return IndentifierConstant(&parser.previous);
+	return GlobalSlot(&parser.previous);
 }
 static void MarkInitialized() {
 	if (current->scope_depth == 0) {
@@ -620,16 +749,16 @@ static void MarkInitialized() {
 	current->locals[current->local_count - 1].depth =
 		current->scope_depth;
 }
-static void DefineVariable(uint8_t index) {
+static void DefineVariable(uint16_t index) {
 	if (current->scope_depth > 0) {
 		MarkInitialized();
 		return;
 	}
 
-	EmitBytes(OP_DEFINE_GLOBAL, index);
+	EmitGlobal(OP_DEFINE_GLOBAL, index);
 }
 static void VarDeclaration() {
-	uint8_t global = ParseVariable("expect variable name.");
+	uint16_t global = ParseVariable("expect variable name.");
 	if (Match(TOKEN_EQUAL)) {
 		Expression();
 	}
@@ -639,11 +768,7 @@ static void VarDeclaration() {
 	Consume(TOKEN_SEMICOLON, "expect ';' after variable declaration.");
 	DefineVariable(global);
 }
-static void Function(FunctionType type) {
-	Compiler compiler;
-	InitCompiler(&compiler, type);
-	
-	BeginScope();
+static void Parameters() {
 	Consume(TOKEN_LEFT_PAREN, "expect '(' after function name.");
 	if (!Check(TOKEN_RIGHT_PAREN)) {
 		do {
@@ -651,16 +776,59 @@ static void Function(FunctionType type) {
 			if (current->function->arity > 255) {
 				ErrorAtCurrent("can not have more than 255 parameters.");
 			}
-			uint8_t index = ParseVariable("expect parameter name.");
+			uint16_t index = ParseVariable("expect parameter name.");
 			DefineVariable(index);
 		} while (Match(TOKEN_COMMA));
 	}
 	Consume(TOKEN_RIGHT_PAREN, "expect ')' after function parameter list.");
 	Consume(TOKEN_LEFT_BRACE, "expect '{' before function body.");
+}
+// skips the body of the function being compiled, leaving it to
+// CompileLazyFunction(). the body is still parsed, without emitting
+// anything, so syntax errors are reported when the script loads and
+// the upvalues are resolved the same way compiling it would.
+static ObjFunction* SkipFunctionBody(const char* start, int line) {
+	// a body nested in one being skipped is only checked.
+	bool nested = parser.syntax_only;
+	parser.syntax_only = true;
 	Block();
-	EndScope();
-	
-	ObjFunction* function = EndCompiler();
+	parser.syntax_only = nested;
+
+	ObjFunction* function = current->function;
+	if (!nested) {
+		int capture_count = function->upvalue_count;
+		LazyFunction* lazy = ALLOCATE(LazyFunction, 1);
+		lazy->start = start;
+		lazy->end = parser.lazy_end;
+		lazy->line = line;
+		lazy->captures = ALLOCATE(LazyCapture, capture_count);
+		lazy->capture_count = capture_count;
+		for (int i = 0; i < capture_count; i++) {
+			lazy->captures[i].start = current->upvalues[i].name.start;
+			lazy->captures[i].length = current->upvalues[i].name.length;
+		}
+		function->lazy = lazy;
+	}
+	current = current->enclosing;
+	return function;
+}
+static void Function(FunctionType type) {
+	Compiler compiler;
+	InitCompiler(&compiler, type);
+	const char* start = parser.current.start;
+	int line = parser.current.line;
+
+	BeginScope();
+	Parameters();
+	ObjFunction* function;
+	if (parser.lazy_end != NULL) {
+		function = SkipFunctionBody(start, line);
+	}
+	else {
+		Block();
+		EndScope();
+		function = EndCompiler();
+	}
 	EmitBytes(OP_CLOSURE, MakeConstant(OBJ_VAL(function)));
 
 	for (int i = 0; i < function->upvalue_count; i++) {
@@ -669,7 +837,7 @@ static void Function(FunctionType type) {
 	}
 }
 static void FunDeclaration() {
-	uint8_t index = ParseVariable("expect function name.");
+	uint16_t index = ParseVariable("expect function name.");
 	MarkInitialized();
 	Function(TYPE_FUNCTION);
 	DefineVariable(index);
@@ -694,6 +862,9 @@ static void InitCompiler(Compiler* compiler, FunctionType type) {
 	compiler->type = type;
 	compiler->local_count = 0;
 	compiler->scope_depth = 0;
+	compiler->last_call_end = -1;
+	compiler->lazy = NULL;
+	memset(compiler->constant_slots, -1, sizeof(compiler->constant_slots));
 	compiler->function = NewFunction();
 	current = compiler;
 	if (type != TYPE_SCRIPT) {
@@ -710,6 +881,9 @@ static void InitCompiler(Compiler* compiler, FunctionType type) {
 static ObjFunction* EndCompiler() {
 	EmitReturn();
 	ObjFunction* function = current->function;
+	if (!parser.had_error) {
+		OptimizeChunk(CurrentChunk());
+	}
 #ifdef DEBUG_PRINT_CODE
 	if (!parser.had_error) {
 		DisassembleChunk(CurrentChunk(), function->name != NULL ?
@@ -720,13 +894,19 @@ static ObjFunction* EndCompiler() {
 	return function;
 }
 
-ObjFunction* Compile(const char* source) {
-	InitScanner(source);
+ObjFunction* Compile(const char* source, size_t length) {
+	InitScanner(source, length);
 	Compiler compiler;
 	InitCompiler(&compiler, TYPE_SCRIPT);
 	//compiling_chunk = chunk;
 	parser.had_error = false;
 	parser.panic_mode = false;
+	parser.syntax_only = false;
+#ifdef LAZY_COMPILE
+	parser.lazy_end = source + length;
+#else
+	parser.lazy_end = NULL;
+#endif // LAZY_COMPILE
 
 	Advance();
 	while (!Match(TOKEN_EOF)) {
@@ -753,3 +933,80 @@ ObjFunction* Compile(const char* source) {
 		if (token.type == TOKEN_EOF) break;
 	}*/
 }
+InterpretResult CompileStream(FILE* stream, InterpretResult (*run)(ObjFunction* function))
+{
+	InitStreamScanner(stream);
+	parser.had_error = false;
+	parser.panic_mode = false;
+	parser.syntax_only = false;
+	// the stream is gone by the time a body would be compiled.
+	parser.lazy_end = NULL;
+
+	InterpretResult result = INTERPRET_OK;
+	Advance();
+	while (result == INTERPRET_OK && !Match(TOKEN_EOF)) {
+		Compiler compiler;
+		InitCompiler(&compiler, TYPE_SCRIPT);
+		// declarations are batched into one script until the scanner
+		// has moved on to a new block, or the constant table fills up.
+		do {
+			Declaration();
+		} while (!Check(TOKEN_EOF) && !parser.had_error && !CanReleaseSource() &&
+			CurrentChunk()->constants.count < UINT8_COUNT / 2);
+		ObjFunction* function = EndCompiler();
+		if (parser.had_error) {
+			result = INTERPRET_COMPILE_ERROR;
+			break;
+		}
+		// only the lookahead token still points into the source.
+		parser.previous = parser.current;
+		ReleaseSource(parser.current.start);
+		result = run(function);
+	}
+	FreeScanner();
+	return result;
+}
+bool CompileLazyFunction(ObjFunction* function)
+{
+	LazyFunction* lazy = function->lazy;
+	ResumeScanner(lazy->start, lazy->end, lazy->line);
+	parser.had_error = false;
+	parser.panic_mode = false;
+	parser.syntax_only = false;
+	parser.lazy_end = lazy->end;
+	// InitCompiler() names the function after the previous token.
+	parser.previous.start = function->name->str;
+	parser.previous.length = function->name->length;
+
+	Compiler compiler;
+	InitCompiler(&compiler, TYPE_FUNCTION);
+	compiler.lazy = lazy;
+	Advance();
+	BeginScope();
+	Parameters();
+	Block();
+	EndScope();
+	ObjFunction* compiled = EndCompiler();
+	if (parser.had_error) return false;
+
+	// the stub is the function the closures already refer to, it takes
+	// over the compiled code.
+	FreeChunk(&function->chunk);
+	function->chunk = compiled->chunk;
+	InitChunk(&compiled->chunk);
+	for (int i = 0; i < function->chunk.constants.count; i++) {
+		WRITE_BARRIER(function->chunk.constants.values[i]);
+	}
+	FREE_ARRAY(LazyCapture, lazy->captures, lazy->capture_count);
+	FREE(LazyFunction, lazy);
+	function->lazy = NULL;
+	return true;
+}
+void MarkCompilerRoots()
+{
+	Compiler* compiler = current;
+	while (compiler != NULL) {
+		MarkObject((Obj*)compiler->function);
+		compiler = compiler->enclosing;
+	}
+}
@@ -1,9 +1,20 @@
 #ifndef CLOC_COMPILER_H
 #define CLOC_COMPILER_H
 
+#include <stdio.h>
+
 #include "vm.h"
 
 
-ObjFunction* Compile(const char* source);
+// with LAZY_COMPILE, function bodies are compiled from the source on
+// their first call, so it has to outlive the compiled code.
+ObjFunction* Compile(const char* source, size_t length);
+// compiles a stream a few top level declarations at a time, each batch
+// is run as a script of its own before the rest is read. stops at the
+// first compile or runtime error.
+InterpretResult CompileStream(FILE* stream, InterpretResult (*run)(ObjFunction* function));
+// compiles the body of a function Compile() left for its first call.
+bool CompileLazyFunction(ObjFunction* function);
+void MarkCompilerRoots();
 
 #endif // !CLOC_COMPILER_H
@@ -5,6 +5,7 @@
 
 #include "value.h"
 #include "object.h"
+#include "vm.h"
 
 static int SimpleInstruction(const char* name, int offset) {
 	printf("%s\n", name);
@@ -25,6 +26,22 @@ static ByteInstruction(const char* name, Chunk* chunk, int offset) {
 	return offset + 2;
 }
 
+static int TwoByteInstruction(const char* name, Chunk* chunk, int offset) {
+	uint8_t first = chunk->code[offset + 1];
+	uint8_t second = chunk->code[offset + 2];
+	printf("%-16s %4d %4d\n", name, first, second);
+	return offset + 3;
+}
+
+static int GlobalInstruction(const char* name, Chunk* chunk, int offset) {
+	uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+	slot |= (uint16_t)(chunk->code[offset + 2]);
+	printf("%-16s %4d '", name, slot);
+	PrintValue(vm.global_names.values[slot]);
+	printf("'\n");
+	return offset + 3;
+}
+
 static JumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
 	uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
 	jump |= (uint16_t)(chunk->code[offset + 2]);
@@ -38,16 +55,20 @@ void DisassembleChunk(Chunk* chunk, const char* name)
 	for (int offset = 0; offset < chunk->count; ) {
 		offset = DisassembleInstruction(chunk, offset);
 	}
+	printf("-- %d bytes of code, %d line runs in %zu bytes (%zu as one int per byte)\n",
+		chunk->count, chunk->line_count, sizeof(LineStart) * chunk->line_count,
+		sizeof(int) * chunk->count);
 }
 
 int DisassembleInstruction(Chunk* chunk, int offset)
 {
 	printf("%04d ", offset);
-	if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+	int line = GetLine(chunk, offset);
+	if (offset > 0 && line == GetLine(chunk, offset - 1)) {
 		printf("   | ");
 	}
 	else {
-		printf("%4d ", chunk->lines[offset]);
+		printf("%4d ", line);
 	}
 
 	uint8_t instruction = chunk->code[offset];
@@ -73,6 +94,9 @@ int DisassembleInstruction(Chunk* chunk, int offset)
 	case OP_CALL: {
 		return ByteInstruction("OP_CALL", chunk, offset);
 	}
+	case OP_TAIL_CALL: {
+		return ByteInstruction("OP_TAIL_CALL", chunk, offset);
+	}
 	case OP_CLOSURE: {
 		offset++;
 		uint8_t constant = chunk->code[offset++];
@@ -100,11 +124,17 @@ int DisassembleInstruction(Chunk* chunk, int offset)
 	case OP_JUMP_IF_FALSE: {
 		return JumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
 	}
+	case OP_JUMP_IF_TRUE: {
+		return JumpInstruction("OP_JUMP_IF_TRUE", 1, chunk, offset);
+	}
 	case OP_POP: {
 		return SimpleInstruction("OP_POP", offset);
 	}
+	case OP_POPN: {
+		return ByteInstruction("OP_POPN", chunk, offset);
+	}
 	case OP_DEFINE_GLOBAL: {
-		return ConstantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+		return GlobalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
 	}
 	case OP_GET_LOCAL: {
 		return ByteInstruction("OP_GET_LOCAL", chunk, offset);
@@ -119,10 +149,10 @@ int DisassembleInstruction(Chunk* chunk, int offset)
 		return ByteInstruction("OP_SET_UPVALUE", chunk, offset);
 	}
 	case OP_GET_GLOBAL: {
-		return ConstantInstruction("OP_GET_GLOBAL", chunk, offset);
+		return GlobalInstruction("OP_GET_GLOBAL", chunk, offset);
 	}
 	case OP_SET_GLOBAL: {
-		return ConstantInstruction("OP_SET_GLOBAL", chunk, offset);
+		return GlobalInstruction("OP_SET_GLOBAL", chunk, offset);
 	}
 	case OP_NOT: {
 		return SimpleInstruction("OP_NOT", offset);
@@ -151,9 +181,192 @@ int DisassembleInstruction(Chunk* chunk, int offset)
 	case OP_DIVIDE: {
 		return SimpleInstruction("OP_DIVIDE", offset);
 	}
+	case OP_ADD_CONSTANT: {
+		return ConstantInstruction("OP_ADD_CONSTANT", chunk, offset);
+	}
+	case OP_SUBTRACT_CONSTANT: {
+		return ConstantInstruction("OP_SUBTRACT_CONSTANT", chunk, offset);
+	}
+	case OP_LESS_CONSTANT: {
+		return ConstantInstruction("OP_LESS_CONSTANT", chunk, offset);
+	}
+	case OP_SET_LOCAL_POP: {
+		return ByteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+	}
+	case OP_ADD_LOCALS: {
+		return TwoByteInstruction("OP_ADD_LOCALS", chunk, offset);
+	}
+	case OP_JUMP_IF_LESS: {
+		return JumpInstruction("OP_JUMP_IF_LESS", 1, chunk, offset);
+	}
+	case OP_JUMP_IF_NOT_LESS: {
+		return JumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+	}
+	case OP_JUMP_IF_GREATER: {
+		return JumpInstruction("OP_JUMP_IF_GREATER", 1, chunk, offset);
+	}
+	case OP_JUMP_IF_NOT_GREATER: {
+		return JumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+	}
+	case OP_JUMP_IF_EQUAL: {
+		return JumpInstruction("OP_JUMP_IF_EQUAL", 1, chunk, offset);
+	}
+	case OP_JUMP_IF_NOT_EQUAL: {
+		return JumpInstruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+	}
+	case OP_POP_JUMP_IF_FALSE: {
+		return JumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+	}
+	case OP_POP_JUMP_IF_TRUE: {
+		return JumpInstruction("OP_POP_JUMP_IF_TRUE", 1, chunk, offset);
+	}
 
 	default:
 		printf("unknow opcode %d\n", instruction);
 		return offset + 1;
 	}
 }
+
+#ifdef DEBUG_PROFILE_OPCODES
+#include <stdlib.h>
+
+#define PROFILE_TOP 20
+#define TRIPLE_TABLE_SIZE 4096
+#define TRIPLE_USED 0x1000000u
+
+typedef struct {
+	uint32_t key;
+	uint64_t count;
+} NgramCount;
+
+static const char* op_names[UINT8_COUNT] = {
+	[OP_CONSTANT] = "OP_CONSTANT",
+	[OP_NIL] = "OP_NIL",
+	[OP_TRUE] = "OP_TRUE",
+	[OP_FALSE] = "OP_FALSE",
+	[OP_PRINT] = "OP_PRINT",
+	[OP_RETURN] = "OP_RETURN",
+	[OP_CALL] = "OP_CALL",
+	[OP_TAIL_CALL] = "OP_TAIL_CALL",
+	[OP_CLOSURE] = "OP_CLOSURE",
+	[OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+	[OP_LOOP] = "OP_LOOP",
+	[OP_JUMP] = "OP_JUMP",
+	[OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+	[OP_JUMP_IF_TRUE] = "OP_JUMP_IF_TRUE",
+	[OP_POP] = "OP_POP",
+	[OP_POPN] = "OP_POPN",
+	[OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+	[OP_GET_LOCAL] = "OP_GET_LOCAL",
+	[OP_SET_LOCAL] = "OP_SET_LOCAL",
+	[OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+	[OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+	[OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+	[OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+	[OP_NOT] = "OP_NOT",
+	[OP_NEGATE] = "OP_NEGATE",
+	[OP_EQUAL] = "OP_EQUAL",
+	[OP_GREATER] = "OP_GREATER",
+	[OP_LESS] = "OP_LESS",
+	[OP_ADD] = "OP_ADD",
+	[OP_SUBTRACT] = "OP_SUBTRACT",
+	[OP_MULTIPLY] = "OP_MULTIPLY",
+	[OP_DIVIDE] = "OP_DIVIDE",
+	[OP_ADD_CONSTANT] = "OP_ADD_CONSTANT",
+	[OP_SUBTRACT_CONSTANT] = "OP_SUBTRACT_CONSTANT",
+	[OP_LESS_CONSTANT] = "OP_LESS_CONSTANT",
+	[OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+	[OP_ADD_LOCALS] = "OP_ADD_LOCALS",
+	[OP_JUMP_IF_LESS] = "OP_JUMP_IF_LESS",
+	[OP_JUMP_IF_NOT_LESS] = "OP_JUMP_IF_NOT_LESS",
+	[OP_JUMP_IF_GREATER] = "OP_JUMP_IF_GREATER",
+	[OP_JUMP_IF_NOT_GREATER] = "OP_JUMP_IF_NOT_GREATER",
+	[OP_JUMP_IF_EQUAL] = "OP_JUMP_IF_EQUAL",
+	[OP_JUMP_IF_NOT_EQUAL] = "OP_JUMP_IF_NOT_EQUAL",
+	[OP_POP_JUMP_IF_FALSE] = "OP_POP_JUMP_IF_FALSE",
+	[OP_POP_JUMP_IF_TRUE] = "OP_POP_JUMP_IF_TRUE",
+};
+static uint64_t executed_count = 0;
+static uint64_t pair_counts[UINT8_COUNT][UINT8_COUNT];
+static NgramCount triple_counts[TRIPLE_TABLE_SIZE];
+static int history[2] = { -1, -1 };
+
+static const char* OpName(int op) {
+	return op_names[op] != NULL ? op_names[op] : "?";
+}
+
+static void CountTriple(uint32_t key) {
+	key |= TRIPLE_USED;
+	uint32_t index = (key * 2654435761u) & (TRIPLE_TABLE_SIZE - 1);
+	for (int i = 0; i < TRIPLE_TABLE_SIZE; i++) {
+		NgramCount* entry = &triple_counts[index];
+		if (entry->key == key || entry->key == 0) {
+			entry->key = key;
+			entry->count++;
+			return;
+		}
+		index = (index + 1) & (TRIPLE_TABLE_SIZE - 1);
+	}
+}
+
+static int CompareCounts(const void* a, const void* b) {
+	uint64_t x = ((const NgramCount*)a)->count;
+	uint64_t y = ((const NgramCount*)b)->count;
+	return (x < y) - (x > y);
+}
+
+void ProfileInstruction(uint8_t instruction)
+{
+	executed_count++;
+	if (history[1] != -1) {
+		pair_counts[history[1]][instruction]++;
+		if (history[0] != -1) {
+			CountTriple(((uint32_t)history[0] << 16) |
+				((uint32_t)history[1] << 8) | instruction);
+		}
+	}
+	history[0] = history[1];
+	history[1] = instruction;
+}
+
+void PrintOpcodeProfile()
+{
+	int count = 0;
+	NgramCount* pairs = malloc(sizeof(NgramCount) * UINT8_COUNT * UINT8_COUNT);
+	if (pairs == NULL) return;
+	for (int a = 0; a < UINT8_COUNT; a++) {
+		for (int b = 0; b < UINT8_COUNT; b++) {
+			if (pair_counts[a][b] == 0) continue;
+			pairs[count].key = (uint32_t)(a << 8 | b);
+			pairs[count].count = pair_counts[a][b];
+			count++;
+		}
+	}
+	qsort(pairs, count, sizeof(NgramCount), CompareCounts);
+	printf("== %llu instructions, hottest pairs ==\n",
+		(unsigned long long)executed_count);
+	for (int i = 0; i < count && i < PROFILE_TOP; i++) {
+		printf("%6.2f%% %s %s\n",
+			100.0 * pairs[i].count / executed_count,
+			OpName(pairs[i].key >> 8), OpName(pairs[i].key & 0xff));
+	}
+	free(pairs);
+
+	NgramCount triples[TRIPLE_TABLE_SIZE];
+	count = 0;
+	for (int i = 0; i < TRIPLE_TABLE_SIZE; i++) {
+		if (triple_counts[i].key != 0) {
+			triples[count++] = triple_counts[i];
+		}
+	}
+	qsort(triples, count, sizeof(NgramCount), CompareCounts);
+	printf("== hottest triples ==\n");
+	for (int i = 0; i < count && i < PROFILE_TOP; i++) {
+		printf("%6.2f%% %s %s %s\n",
+			100.0 * triples[i].count / executed_count,
+			OpName((triples[i].key >> 16) & 0xff),
+			OpName((triples[i].key >> 8) & 0xff),
+			OpName(triples[i].key & 0xff));
+	}
+}
+#endif // DEBUG_PROFILE_OPCODES
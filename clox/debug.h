@@ -6,4 +6,9 @@
 void DisassembleChunk(Chunk* chunk, const char* name);
 int DisassembleInstruction(Chunk* chunk, int offset);
 
+#ifdef DEBUG_PROFILE_OPCODES
+void ProfileInstruction(uint8_t instruction);
+void PrintOpcodeProfile();
+#endif // DEBUG_PROFILE_OPCODES
+
 #endif // !CLOX_DEBUG_H
@@ -0,0 +1,58 @@
+#include "file.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // !_WIN32
+
+bool MapFile(const char* path, MappedFile* map) {
+#ifdef _WIN32
+	map->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (map->file == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(map->file, &size) || size.QuadPart == 0) {
+		CloseHandle(map->file);
+		return false;
+	}
+	map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (map->mapping == NULL) {
+		CloseHandle(map->file);
+		return false;
+	}
+	map->data = (const char*)MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0);
+	if (map->data == NULL) {
+		CloseHandle(map->mapping);
+		CloseHandle(map->file);
+		return false;
+	}
+	map->size = (size_t)size.QuadPart;
+	return true;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	void* data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) return false;
+	map->data = (const char*)data;
+	map->size = (size_t)info.st_size;
+	return true;
+#endif // _WIN32
+}
+
+void UnmapFile(MappedFile* map) {
+#ifdef _WIN32
+	UnmapViewOfFile(map->data);
+	CloseHandle(map->mapping);
+	CloseHandle(map->file);
+#else
+	munmap((void*)map->data, map->size);
+#endif // _WIN32
+}
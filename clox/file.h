@@ -0,0 +1,25 @@
+#ifndef CLOX_FILE_H
+#define CLOX_FILE_H
+
+#include <stddef.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif // _WIN32
+
+#include "common.h"
+
+// a read only view of a whole file. the data is not NUL terminated,
+// and mapping an empty file or a pipe fails.
+typedef struct {
+	const char* data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif // _WIN32
+} MappedFile;
+
+bool MapFile(const char* path, MappedFile* map);
+void UnmapFile(MappedFile* map);
+
+#endif // !CLOX_FILE_H
@@ -3,8 +3,12 @@
 #include <string.h>
 
 
+#include "bench.h"
+#include "cache.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "file.h"
 #include "vm.h"
 
 static void Repl() {
@@ -19,36 +23,42 @@ static void Repl() {
     }
 }
 
-static char* ReadFile(const char* path) {
-    FILE* fp = NULL;
-    fopen_s(&fp, path, "rb");
-    if (fp == NULL) {
-        fprintf(stderr, "could not open file '%s'.", path);
-        exit(74);
+// scripts are mapped rather than read, a script that cannot be mapped
+// (stdin as "-", a pipe) is streamed and runs as it is read.
+static InterpretResult RunSource(const char* path, const char* source, size_t length) {
+#ifdef BYTECODE_CACHE
+    ObjFunction* function = LoadCachedFunction(path, source, length);
+    if (function == NULL) {
+        function = Compile(source, length);
+        if (function != NULL) SaveCachedFunction(path, source, length, function);
     }
-    fseek(fp, 0L, SEEK_END);
-    size_t file_size = ftell(fp);
-    rewind(fp);
-    char* buffer = (char*)malloc(file_size + 1);
-    if (buffer == NULL) {
-        fprintf(stderr, "not enough memroy to read '%s'.", path);
-        exit(74);
-    }
-    size_t byte_read = fread(buffer, sizeof(char), file_size, fp);
-    if (byte_read != file_size) {
-        fprintf(stderr, "could not read file '%s'.", path);
-        exit(74);
-    }
-    buffer[byte_read] = '\0';
-    fclose(fp);
-
-    return buffer;
+    return function == NULL
+        ? INTERPRET_COMPILE_ERROR
+        : InterpretFunction(function);
+#else
+    return Interpret(source, length);
+#endif // BYTECODE_CACHE
 }
 
 static void RunFile(const char* path) {
-    char* source = ReadFile(path);
-    InterpretResult ret = Interpret(source);
-    free(source);
+    InterpretResult ret;
+    MappedFile source;
+    if (strcmp(path, "-") == 0) {
+        ret = InterpretStream(stdin);
+    }
+    else if (MapFile(path, &source)) {
+        ret = RunSource(path, source.data, source.size);
+        UnmapFile(&source);
+    }
+    else {
+        FILE* fp = fopen(path, "rb");
+        if (fp == NULL) {
+            fprintf(stderr, "could not open file '%s'.", path);
+            exit(74);
+        }
+        ret = InterpretStream(fp);
+        fclose(fp);
+    }
 
     if (ret == INTERPRET_COMPILE_ERROR) exit(65);
     if (ret == INTERPRET_RUNTIME_ERROR) exit(70);
@@ -63,6 +73,11 @@ int main(int argc, const char* argv[])
     else if (argc == 2) {
         RunFile(argv[1]);
     }
+#ifdef DEBUG_BENCHMARK
+    else if (argc == 3 && strcmp(argv[1], "--bench") == 0) {
+        if (!RunBenchmark(argv[2])) exit(64);
+    }
+#endif // DEBUG_BENCHMARK
     else {
         fprintf(stderr, "usage: clox [path]\n");
         exit(64);
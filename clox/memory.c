@@ -1,18 +1,35 @@
 #include "memory.h"
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
+#include "compiler.h"
 #include "vm.h"
 #include "object.h"
 
+#ifdef DEBUG_LOG_GC
+#include "debug.h"
+#endif // DEBUG_LOG_GC
+
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_HEAP_MIN (1024 * 1024)
+#define GC_STEP_SIZE (64 * 1024)
+#define GC_STEP_WORK 64
+
 
 static void FreeObject(Obj* obj) {
+#ifdef DEBUG_LOG_GC
+	printf("%p free type %d\n", (void*)obj, obj->type);
+#endif // DEBUG_LOG_GC
+
 	switch (obj->type)
 	{
 	case OBJ_STRING: {
+		// only flat strings carry their characters.
 		ObjString* obj_str = (ObjString*)(obj);
-		FREE_ARRAY(char, obj_str->str, obj_str->length);
-		FREE(ObjString, obj);
+		reallocate(obj, sizeof(ObjString) +
+			(obj_str->left == NULL ? obj_str->length + 1 : 0), 0);
 		break;
 	}
 	case OBJ_UPVALUE: {
@@ -22,6 +39,10 @@ static void FreeObject(Obj* obj) {
 	case OBJ_FUNCTION: {
 		ObjFunction* function = (ObjFunction*)(obj);
 		FreeChunk(&function->chunk);
+		if (function->lazy != NULL) {
+			FREE_ARRAY(LazyCapture, function->lazy->captures, function->lazy->capture_count);
+			FREE(LazyFunction, function->lazy);
+		}
 		FREE(ObjFunction, function);
 		break;
 	}
@@ -40,8 +61,72 @@ static void FreeObject(Obj* obj) {
 	}
 }
 
+static uint64_t NowNs() {
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void RecordPause(uint64_t ns) {
+	GcPauses* pauses = &vm.gc_pauses;
+	int bucket = 0;
+	for (uint64_t us = ns / 1000; us != 0; us >>= 1) {
+		bucket++;
+	}
+	if (bucket >= GC_PAUSE_BUCKETS) {
+		bucket = GC_PAUSE_BUCKETS - 1;
+	}
+	pauses->buckets[bucket]++;
+	pauses->count++;
+	pauses->total_ns += ns;
+	if (ns > pauses->max_ns) {
+		pauses->max_ns = ns;
+	}
+}
+
 void* reallocate(void* pointer, size_t old_capacity, size_t new_capacity)
 {
+	vm.bytes_allocated += new_capacity - old_capacity;
+	if (new_capacity > old_capacity) {
+#ifdef GC_INCREMENTAL
+		vm.gc_debt += new_capacity - old_capacity;
+#ifdef DEBUG_STRESS_GC
+		GcStep();
+#else
+		if (vm.gc_phase != GC_PHASE_IDLE ?
+			vm.gc_debt >= GC_STEP_SIZE : vm.bytes_allocated > vm.next_gc) {
+			GcStep();
+		}
+#endif // DEBUG_STRESS_GC
+#else
+#ifdef DEBUG_STRESS_GC
+		CollectGarbage();
+#endif // DEBUG_STRESS_GC
+		if (vm.bytes_allocated > vm.next_gc) {
+			CollectGarbage();
+		}
+#endif // GC_INCREMENTAL
+	}
+
+	if (new_capacity == 0) {
+		free(pointer);
+		return NULL;
+	}
+
+	void* result = realloc(pointer, new_capacity);
+	if (result == NULL) exit(1);
+	return result;
+}
+
+void* ReallocateWithoutGc(void* pointer, size_t old_capacity, size_t new_capacity)
+{
+	vm.bytes_allocated += new_capacity - old_capacity;
+#ifdef GC_INCREMENTAL
+	if (new_capacity > old_capacity) {
+		vm.gc_debt += new_capacity - old_capacity;
+	}
+#endif // GC_INCREMENTAL
+
 	if (new_capacity == 0) {
 		free(pointer);
 		return NULL;
@@ -52,6 +137,299 @@ void* reallocate(void* pointer, size_t old_capacity, size_t new_capacity)
 	return result;
 }
 
+void MarkObject(Obj* obj)
+{
+	if (obj == NULL) return;
+	if (obj->is_marked) return;
+
+#ifdef DEBUG_LOG_GC
+	printf("%p mark ", (void*)obj);
+	PrintValue(OBJ_VAL(obj));
+	printf("\n");
+#endif // DEBUG_LOG_GC
+
+	obj->is_marked = true;
+
+	if (vm.gray_count >= vm.gray_capacity) {
+		vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
+		// the gray stack is allocated with the system realloc() so
+		// growing it can not recursively start another collection.
+		vm.gray_stack = (Obj**)realloc(vm.gray_stack,
+			sizeof(Obj*) * vm.gray_capacity);
+		if (vm.gray_stack == NULL) exit(1);
+	}
+	vm.gray_stack[vm.gray_count++] = obj;
+}
+
+void MarkValue(Value value)
+{
+	if (IS_OBJ(value)) MarkObject(AS_OBJ(value));
+}
+
+void ReviveObject(Obj* obj)
+{
+#ifdef GC_INCREMENTAL
+	// a weakly held object (an interned string) is about to be used
+	// again, so it has to survive the cycle that is in progress.
+	if (vm.gc_phase == GC_PHASE_MARK) {
+		MarkObject(obj);
+	}
+	else if (vm.gc_phase == GC_PHASE_SWEEP && obj->swept != vm.swept) {
+		// survivors the sweep already passed are white again, marking
+		// them would carry the mark into the next cycle.
+		obj->is_marked = true;
+	}
+#endif // GC_INCREMENTAL
+}
+
+static void MarkArray(ValueArray* array) {
+	for (int i = 0; i < array->count; i++) {
+		MarkValue(array->values[i]);
+	}
+}
+
+static void BlackenObject(Obj* obj) {
+#ifdef DEBUG_LOG_GC
+	printf("%p blacken ", (void*)obj);
+	PrintValue(OBJ_VAL(obj));
+	printf("\n");
+#endif // DEBUG_LOG_GC
+
+	switch (obj->type) {
+	case OBJ_UPVALUE:
+		MarkValue(((ObjUpvalue*)obj)->closed);
+		break;
+	case OBJ_FUNCTION: {
+		ObjFunction* function = (ObjFunction*)obj;
+		MarkObject((Obj*)function->name);
+		MarkArray(&function->chunk.constants);
+		break;
+	}
+	case OBJ_CLOSURE: {
+		ObjClosure* closure = (ObjClosure*)obj;
+		MarkObject((Obj*)closure->function);
+		for (int i = 0; i < closure->upvalue_count; i++) {
+			MarkObject((Obj*)closure->upvalues[i]);
+		}
+		break;
+	}
+	case OBJ_STRING: {
+		ObjString* string = (ObjString*)obj;
+		MarkObject((Obj*)string->left);
+		MarkObject((Obj*)string->right);
+		break;
+	}
+	case OBJ_NATIVE:
+		break;
+	}
+}
+
+static void MarkRoots() {
+	for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
+		MarkValue(*slot);
+	}
+	for (int i = 0; i < vm.frame_count; i++) {
+		MarkObject((Obj*)vm.frames[i].closure);
+	}
+	for (int i = 0; i < vm.open_upvalue_top; i++) {
+		MarkObject((Obj*)vm.open_upvalues[i]);
+	}
+	MarkTable(&vm.global_slots);
+	MarkArray(&vm.global_values);
+	MarkArray(&vm.global_names);
+	MarkCompilerRoots();
+}
+
+#ifndef GC_INCREMENTAL
+static void TraceReferences() {
+	while (vm.gray_count > 0) {
+		Obj* obj = vm.gray_stack[--vm.gray_count];
+		BlackenObject(obj);
+	}
+}
+#endif // !GC_INCREMENTAL
+
+static void SetNextGc() {
+	vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+	if (vm.next_gc < GC_HEAP_MIN) {
+		vm.next_gc = GC_HEAP_MIN;
+	}
+}
+
+#ifdef GC_INCREMENTAL
+// blackens gray objects until none are left or the deadline passes.
+static bool TraceSome(uint64_t deadline) {
+	for (;;) {
+		for (int i = 0; i < GC_STEP_WORK; i++) {
+			if (vm.gray_count == 0) return true;
+			BlackenObject(vm.gray_stack[--vm.gray_count]);
+		}
+		if (NowNs() >= deadline) return vm.gray_count == 0;
+	}
+}
+
+// frees the unmarked objects of vm.sweep_list and moves the survivors
+// back to vm.obj_head, until the list is empty or the deadline passes.
+static bool SweepSome(uint64_t deadline) {
+	for (;;) {
+		for (int i = 0; i < GC_STEP_WORK; i++) {
+			Obj* obj = vm.sweep_list;
+			if (obj == NULL) return true;
+			vm.sweep_list = obj->next;
+			if (obj->is_marked) {
+				obj->is_marked = false;
+				obj->swept = vm.swept;
+				obj->next = vm.obj_head;
+				vm.obj_head = obj;
+			}
+			else {
+				if (obj->type == OBJ_STRING && ((ObjString*)obj)->is_interned) {
+					TableDelete(&vm.strings, (ObjString*)obj);
+				}
+				FreeObject(obj);
+			}
+		}
+		if (NowNs() >= deadline) return vm.sweep_list == NULL;
+	}
+}
+
+// moves the current cycle forward as far as the deadline allows.
+static void AdvanceCycle(uint64_t deadline) {
+	if (vm.gc_phase == GC_PHASE_IDLE) {
+#ifdef DEBUG_LOG_GC
+		printf("-- gc begin\n");
+#endif // DEBUG_LOG_GC
+		vm.gc_phase = GC_PHASE_MARK;
+		MarkRoots();
+	}
+	if (vm.gc_phase == GC_PHASE_MARK) {
+		// the stack, frames and globals are written without barriers,
+		// so the mark is only final once a rescan of them finds nothing
+		// new. what a rescan does find is traced in slices as well, a
+		// pause only pays for scanning the roots themselves.
+		for (;;) {
+			if (!TraceSome(deadline)) return;
+			MarkRoots();
+			if (vm.gray_count == 0) break;
+		}
+		vm.gc_phase = GC_PHASE_SWEEP;
+		vm.swept = !vm.swept;
+		vm.sweep_list = vm.obj_head;
+		vm.obj_head = NULL;
+	}
+	if (vm.gc_phase == GC_PHASE_SWEEP) {
+		if (!SweepSome(deadline)) return;
+		vm.gc_phase = GC_PHASE_IDLE;
+		SetNextGc();
+#ifdef DEBUG_LOG_GC
+		printf("-- gc end\n");
+		printf("   %zu bytes in use, next at %zu\n",
+			vm.bytes_allocated, vm.next_gc);
+#endif // DEBUG_LOG_GC
+	}
+}
+#else
+static void Sweep() {
+	Obj* prev = NULL;
+	Obj* obj = vm.obj_head;
+	while (obj != NULL) {
+		if (obj->is_marked) {
+			obj->is_marked = false;
+			prev = obj;
+			obj = obj->next;
+		}
+		else {
+			Obj* unreached = obj;
+			obj = obj->next;
+			if (prev != NULL) {
+				prev->next = obj;
+			}
+			else {
+				vm.obj_head = obj;
+			}
+			FreeObject(unreached);
+		}
+	}
+}
+#endif // GC_INCREMENTAL
+
+void GcStep()
+{
+#ifdef GC_INCREMENTAL
+	uint64_t start = NowNs();
+	vm.gc_debt = 0;
+	AdvanceCycle(start + vm.gc_pause_budget);
+	RecordPause(NowNs() - start);
+#else
+	CollectGarbage();
+#endif // GC_INCREMENTAL
+}
+
+void CollectGarbage()
+{
+	uint64_t start = NowNs();
+#ifdef GC_INCREMENTAL
+	// finish the cycle in progress, then run a whole new one so that
+	// everything unreachable at this point gets reclaimed.
+	if (vm.gc_phase != GC_PHASE_IDLE) {
+		AdvanceCycle(UINT64_MAX);
+	}
+	AdvanceCycle(UINT64_MAX);
+#else
+#ifdef DEBUG_LOG_GC
+	printf("-- gc begin\n");
+	size_t before = vm.bytes_allocated;
+#endif // DEBUG_LOG_GC
+
+	MarkRoots();
+	TraceReferences();
+	// interned strings are weak references, drop the ones
+	// nothing else reached before their memory is swept.
+	TableRemoveWhite(&vm.strings);
+	Sweep();
+	SetNextGc();
+
+#ifdef DEBUG_LOG_GC
+	printf("-- gc end\n");
+	printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+		before - vm.bytes_allocated, before, vm.bytes_allocated,
+		vm.next_gc);
+#endif // DEBUG_LOG_GC
+#endif // GC_INCREMENTAL
+	RecordPause(NowNs() - start);
+}
+
+double GcPausePercentile(double percentile)
+{
+	GcPauses* pauses = &vm.gc_pauses;
+	if (pauses->count == 0) return 0;
+
+	uint64_t rank = (uint64_t)(percentile / 100 * (double)pauses->count);
+	if (rank < 1) rank = 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+		seen += pauses->buckets[i];
+		if (seen >= rank) {
+			return (double)((uint64_t)1 << i);
+		}
+	}
+	return (double)pauses->max_ns / 1000;
+}
+
+void PrintGcPauses()
+{
+	GcPauses* pauses = &vm.gc_pauses;
+	printf("gc pauses: %llu, total %.3fms, max %.1fus, p50 < %.0fus, p99 < %.0fus\n",
+		(unsigned long long)pauses->count, (double)pauses->total_ns / 1e6,
+		(double)pauses->max_ns / 1e3,
+		GcPausePercentile(50), GcPausePercentile(99));
+	for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+		if (pauses->buckets[i] == 0) continue;
+		printf("  < %10lluus %llu\n", (unsigned long long)1 << i,
+			(unsigned long long)pauses->buckets[i]);
+	}
+}
+
 void FreeObjects()
 {
 	Obj* obj = vm.obj_head;
@@ -60,4 +438,17 @@ void FreeObjects()
 		FreeObject(obj);
 		obj = next;
 	}
+	obj = vm.sweep_list;
+	while (obj != NULL) {
+		Obj* next = obj->next;
+		FreeObject(obj);
+		obj = next;
+	}
+	vm.obj_head = NULL;
+	vm.sweep_list = NULL;
+
+	free(vm.gray_stack);
+	vm.gray_stack = NULL;
+	vm.gray_count = 0;
+	vm.gray_capacity = 0;
 }
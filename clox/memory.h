@@ -2,6 +2,7 @@
 #define CLOX_MEMORY_H
 
 #include "common.h"
+#include "value.h"
 
 
 #define ALLOCATE(type, count) \
@@ -18,8 +19,30 @@
 	reallocate(pointer, (old_capacity) * sizeof(type), 0)
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+
+// must be used whenever a reference is stored into a heap object
+// or table while an incremental mark may be running; it shades the
+// stored value so no black object ever points to a white one.
+#ifdef GC_INCREMENTAL
+#define WRITE_BARRIER(value) \
+	do { \
+		if (vm.gc_phase == GC_PHASE_MARK) MarkValue(value); \
+	} while (0)
+#else
+#define WRITE_BARRIER(value) ((void)0)
+#endif // GC_INCREMENTAL
 		
 void* reallocate(void* pointer, size_t old_capacity, size_t new_capacity);
+// for callers holding objects no root reaches. the bytes still count,
+// the next allocation that may collect pays for them.
+void* ReallocateWithoutGc(void* pointer, size_t old_capacity, size_t new_capacity);
+void MarkObject(Obj* obj);
+void MarkValue(Value value);
+void ReviveObject(Obj* obj);
+void CollectGarbage();
+void GcStep();
+double GcPausePercentile(double percentile);
+void PrintGcPauses();
 void FreeObjects();
 
 #endif // !CLOX_MEMORY_H
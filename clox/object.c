@@ -1,6 +1,7 @@
 #include "object.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -10,26 +11,93 @@
 #define ALLOCATE_OBJ(type, objectType) \
 	(type*)AllocateObject(sizeof(type), objectType)
 
-static Obj* AllocateObject(size_t size, ObjType type) {
-	Obj* obj = (Obj*)reallocate(NULL, 0, size);
+static Obj* InitObject(Obj* obj, size_t size, ObjType type) {
 	obj->type = type;
+	// objects born during an incremental mark are allocated black.
+	obj->is_marked = (vm.gc_phase == GC_PHASE_MARK);
+#ifdef GC_INCREMENTAL
+	obj->swept = vm.swept;
+#endif // GC_INCREMENTAL
 
 	obj->next = vm.obj_head;
 	vm.obj_head = obj;
 
+#ifdef DEBUG_LOG_GC
+	printf("%p allocate %zu for %d\n", (void*)obj, size, type);
+#endif // DEBUG_LOG_GC
+
 	return obj;
 }
+static Obj* AllocateObject(size_t size, ObjType type) {
+	return InitObject((Obj*)reallocate(NULL, 0, size), size, type);
+}
 
-static ObjString* AllocateString(char* buffer, int length, uint32_t hash) {
-	ObjString* obj_str = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+static ObjString* AllocateString(const char* src, int length, uint32_t hash) {
+	ObjString* obj_str = (ObjString*)AllocateObject(
+		sizeof(ObjString) + length + 1, OBJ_STRING);
 	obj_str->length = length;
-	obj_str->str = buffer;
+	memcpy(obj_str->str, src, length);
+	obj_str->str[length] = '\0';
 	obj_str->hash = hash;
+	obj_str->is_interned = true;
+	obj_str->left = NULL;
+	obj_str->right = NULL;
+	// keep the new string reachable while the intern table grows.
+	PushStack(OBJ_VAL(obj_str));
 	TableSet(&vm.strings, obj_str, NIL_VAL);
+	PopStack();
 	return obj_str;
 }
 
-static uint32_t HashString(const char* src, int length) {
+#ifdef FAST_STRING_HASH
+static inline uint64_t RotateLeft(uint64_t x, int bits) {
+	return (x << bits) | (x >> (64 - bits));
+}
+
+static inline uint64_t MixWord(uint64_t hash, uint64_t word) {
+	word *= 0x87C37B91114253D5u;
+	word = RotateLeft(word, 31);
+	word *= 0x4CF5AD432745937Fu;
+	hash ^= word;
+	return RotateLeft(hash, 27) * 5 + 0x52DCE729u;
+}
+
+// eight bytes a step with murmur3's block mix and finalizer. the tail
+// is read as two overlapping words, and the length seeds the hash so
+// the overlap can not make two strings look alike.
+uint32_t HashString(const char* src, int length)
+{
+	uint64_t hash = 0x9E3779B97F4A7C15u ^ ((uint64_t)length * 0xC2B2AE3D27D4EB4Fu);
+	const char* end = src + length;
+	for (; end - src >= 8; src += 8) {
+		uint64_t word;
+		memcpy(&word, src, sizeof(word));
+		hash = MixWord(hash, word);
+	}
+
+	int rest = (int)(end - src);
+	if (rest >= 4) {
+		uint32_t low, high;
+		memcpy(&low, src, sizeof(low));
+		memcpy(&high, end - 4, sizeof(high));
+		hash = MixWord(hash, ((uint64_t)high << 32) | low);
+	}
+	else if (rest > 0) {
+		hash = MixWord(hash, (uint64_t)(uint8_t)src[0] |
+			(uint64_t)(uint8_t)src[rest / 2] << 8 |
+			(uint64_t)(uint8_t)src[rest - 1] << 16);
+	}
+
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDu;
+	hash ^= hash >> 33;
+	hash *= 0xC4CEB9FE1A85EC53u;
+	hash ^= hash >> 33;
+	return (uint32_t)hash;
+}
+#else
+uint32_t HashString(const char* src, int length)
+{
 	uint32_t hash = 2166136261u;
 	for (int i = 0; i < length; i++) {
 		hash ^= (uint8_t)src[i];
@@ -37,35 +105,94 @@ static uint32_t HashString(const char* src, int length) {
 	}
 	return hash;
 }
+#endif // FAST_STRING_HASH
 
 static void PrintFunction(const ObjFunction* function) {
 	function->name != NULL ?
 		printf("<fn %s>", function->name->str) : printf("<script>");
 }
 
-ObjString* TakeString(char* src, int length)
+ObjString* CopyString(const char* src, int length)
 {
 	uint32_t hash = HashString(src, length);
 	ObjString* interned = TableFindString(&vm.strings, src, length, hash);
 	if (interned != NULL) {
-		FREE_ARRAY(char, src, length + 1);
+		ReviveObject((Obj*)interned);
 		return interned;
 	}
 	return AllocateString(src, length, hash);
 }
 
-ObjString* CopyString(const char* src, int length)
+ObjString* NewRope(ObjString* left, ObjString* right)
 {
-	uint32_t hash = HashString(src, length);
-	ObjString* interned = TableFindString(&vm.strings, src, length, hash);
-	if (interned != NULL) {
-		return interned;
+	ObjString* rope = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+	rope->length = left->length + right->length;
+	rope->hash = 0;
+	rope->is_interned = false;
+	rope->left = left;
+	rope->right = right;
+	WRITE_BARRIER(OBJ_VAL(left));
+	WRITE_BARRIER(OBJ_VAL(right));
+	return rope;
+}
+
+void FlattenString(ObjString* string)
+{
+	if (string->right == NULL) return;
+
+	// the characters go straight into a new flat string, which is made
+	// without collecting so the rope and its halves are not swept.
+	size_t size = sizeof(ObjString) + string->length + 1;
+	ObjString* flat = (ObjString*)InitObject(
+		(Obj*)ReallocateWithoutGc(NULL, 0, size), size, OBJ_STRING);
+	flat->length = string->length;
+	flat->hash = 0;
+	flat->is_interned = false;
+	flat->left = NULL;
+	flat->right = NULL;
+	char* buffer = flat->str;
+	buffer[string->length] = '\0';
+	// the buffer is filled from the end. a rope built by appending
+	// leans left, so the left halves waiting their turn stay few.
+	ObjString** pending = NULL;
+	int pending_count = 0;
+	int pending_capacity = 0;
+	int end = string->length;
+	ObjString* node = string;
+	for (;;) {
+		if (node->right == NULL) {
+			end -= node->length;
+			memcpy(buffer + end, StringChars(node), node->length);
+			if (pending_count == 0) break;
+			node = pending[--pending_count];
+			continue;
+		}
+		if (pending_count == pending_capacity) {
+			pending_capacity = GROW_CAPACITY(pending_capacity);
+			pending = (ObjString**)realloc(pending, sizeof(ObjString*) * pending_capacity);
+			if (pending == NULL) exit(1);
+		}
+		pending[pending_count++] = node->left;
+		node = node->right;
 	}
+	free(pending);
 
-	char* buffer = ALLOCATE(char, length + 1);
-	memcpy(buffer, src, length);
-	buffer[length] = '\0';
-	return AllocateString(buffer, length, hash);
+	string->left = flat;
+	string->right = NULL;
+}
+
+bool StringsEqual(ObjString* a, ObjString* b)
+{
+	if (a == b) return true;
+	if ((a->is_interned && b->is_interned) || a->length != b->length) {
+		return false;
+	}
+	// hashing just to compare costs more than the compare, so hashes
+	// only rule out a match when both are already known.
+	if (a->hash != 0 && b->hash != 0 && a->hash != b->hash) return false;
+	FlattenString(a);
+	FlattenString(b);
+	return memcmp(StringChars(a), StringChars(b), a->length) == 0;
 }
 
 ObjUpvalue* NewUpvalue(Value* value)
@@ -73,7 +200,6 @@ ObjUpvalue* NewUpvalue(Value* value)
 	ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
 	upvalue->location = value;
 	upvalue->closed = NIL_VAL;
-	upvalue->next = NULL;
 	return upvalue;
 }
 
@@ -83,6 +209,7 @@ ObjFunction* NewFunction()
 	function->upvalue_count = 0;
 	function->arity = 0;
 	function->name = NULL;
+	function->lazy = NULL;
 	InitChunk(&function->chunk);
 	return function;
 }
@@ -113,6 +240,7 @@ void PrintObject(Value value)
 	switch (OBJ_TYPE(value))
 	{
 	case OBJ_STRING:
+		FlattenString(AS_STRING(value));
 		printf("%s", AS_CSTRING(value));
 		break;
 	case OBJ_UPVALUE:
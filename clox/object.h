@@ -16,7 +16,7 @@
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
 
-#define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->str)
+#define AS_CSTRING(value) StringChars(AS_STRING(value))
 
 
 typedef enum {
@@ -29,29 +29,63 @@ typedef enum {
 
 struct Obj {
 	ObjType type;
+	bool is_marked;
+#ifdef GC_INCREMENTAL
+	// equal to vm.swept once the sweep in progress has passed the
+	// object, and whenever no sweep is running.
+	bool swept;
+#endif // GC_INCREMENTAL
 	struct Obj* next;
 };
 
+// a concatenation may leave a rope, a string made of a left and a
+// right half that is only flattened when its characters are needed.
+// ropes are never interned.
 struct ObjString {
 	Obj obj;
 	int length;
-	char* str;
+	// 0 for ropes, only interned strings are ever looked up by hash.
 	uint32_t hash;
+	// interned strings are equal only when they are the same object.
+	bool is_interned;
+	// NULL for a flat string. a flattened rope keeps its characters in
+	// the flat string left and its right is NULL.
+	struct ObjString* left;
+	struct ObjString* right;
+	// the characters of a flat string, in the same allocation.
+	char str[];
 };
 
 typedef struct ObjUpvalue {
 	Obj obj;
 	Value* location;
 	Value closed;
-	struct ObjUpvalue* next;
 } ObjUpvalue;
 
+typedef struct {
+	const char* start;
+	int length;
+} LazyCapture;
+
+// a function body left to compile on its first call.
+typedef struct {
+	// the parameter list, in a source that outlives the function.
+	const char* start;
+	const char* end;
+	int line;
+	// upvalue i of the function is the enclosing variable captures[i].
+	LazyCapture* captures;
+	int capture_count;
+} LazyFunction;
+
 typedef struct {
 	Obj obj;
 	int upvalue_count;
 	int arity;
 	Chunk chunk;
 	ObjString* name;
+	// NULL once the body is compiled.
+	LazyFunction* lazy;
 } ObjFunction;
 
 typedef struct {
@@ -68,8 +102,13 @@ typedef struct {
 	NativeFn function;
 } ObjNative;
 
-ObjString* TakeString(char* src, int length);
+// FAST_STRING_HASH picks a word at a time hash, FNV-1a without it.
+uint32_t HashString(const char* src, int length);
 ObjString* CopyString(const char* src, int length);
+ObjString* NewRope(ObjString* left, ObjString* right);
+// flattening never collects, so it is safe on unrooted strings.
+void FlattenString(ObjString* string);
+bool StringsEqual(ObjString* a, ObjString* b);
 ObjUpvalue* NewUpvalue(Value* value);
 ObjFunction* NewFunction();
 ObjClosure* NewClosure(ObjFunction* function);
@@ -80,4 +119,9 @@ static inline bool IsObjType(Value value, ObjType type) {
 	return IS_OBJ(value) && (AS_OBJ(value)->type == type);
 }
 
+// the string must be flat or flattened.
+static inline const char* StringChars(const ObjString* string) {
+	return string->left != NULL ? string->left->str : string->str;
+}
+
 #endif // !CLOX_OBJECT_H
@@ -0,0 +1,818 @@
+#include "optimizer.h"
+
+#include <limits.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+
+// a decoded instruction. jumps keep the index of the instruction they
+// land on instead of a byte offset, so passes can add and drop code
+// freely and the offsets are recomputed when the chunk is encoded.
+typedef struct {
+	uint8_t op;
+	uint8_t a;
+	uint8_t b;
+	int line;
+	int target;
+	int source;
+	bool is_target;
+	bool is_dead;
+} Instruction;
+
+typedef struct {
+	Instruction* code;
+	int count;
+	// bytes of the chunk being rewritten, OP_CLOSURE copies its
+	// upvalue pairs from here.
+	const uint8_t* source;
+} Program;
+
+static bool IsJump(uint8_t op) {
+	switch (op) {
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_JUMP_IF_TRUE:
+	case OP_LOOP:
+	case OP_JUMP_IF_LESS:
+	case OP_JUMP_IF_NOT_LESS:
+	case OP_JUMP_IF_GREATER:
+	case OP_JUMP_IF_NOT_GREATER:
+	case OP_JUMP_IF_EQUAL:
+	case OP_JUMP_IF_NOT_EQUAL:
+	case OP_POP_JUMP_IF_FALSE:
+	case OP_POP_JUMP_IF_TRUE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool IsUnconditionalJump(uint8_t op) {
+	return op == OP_JUMP || op == OP_LOOP;
+}
+
+// how many values a branch pops, on both of its edges.
+static int PoppedByJump(uint8_t op) {
+	switch (op) {
+	case OP_POP_JUMP_IF_FALSE:
+	case OP_POP_JUMP_IF_TRUE:
+		return 1;
+	case OP_JUMP_IF_LESS:
+	case OP_JUMP_IF_NOT_LESS:
+	case OP_JUMP_IF_GREATER:
+	case OP_JUMP_IF_NOT_GREATER:
+	case OP_JUMP_IF_EQUAL:
+	case OP_JUMP_IF_NOT_EQUAL:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+static int OperandCount(uint8_t op) {
+	switch (op) {
+	case OP_CONSTANT:
+	case OP_CALL:
+	case OP_TAIL_CALL:
+	case OP_CLOSURE:
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+	case OP_GET_UPVALUE:
+	case OP_SET_UPVALUE:
+	case OP_ADD_CONSTANT:
+	case OP_SUBTRACT_CONSTANT:
+	case OP_LESS_CONSTANT:
+	case OP_SET_LOCAL_POP:
+	case OP_POPN:
+		return 1;
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_JUMP_IF_TRUE:
+	case OP_LOOP:
+	case OP_JUMP_IF_LESS:
+	case OP_JUMP_IF_NOT_LESS:
+	case OP_JUMP_IF_GREATER:
+	case OP_JUMP_IF_NOT_GREATER:
+	case OP_JUMP_IF_EQUAL:
+	case OP_JUMP_IF_NOT_EQUAL:
+	case OP_POP_JUMP_IF_FALSE:
+	case OP_POP_JUMP_IF_TRUE:
+	case OP_ADD_LOCALS:
+	case OP_DEFINE_GLOBAL:
+	case OP_GET_GLOBAL:
+	case OP_SET_GLOBAL:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+static int UpvalueCount(Chunk* chunk, const Instruction* instruction) {
+	return AS_FUNCTION(chunk->constants.values[instruction->a])->upvalue_count;
+}
+
+static int EncodedLength(Chunk* chunk, const Instruction* instruction) {
+	int length = 1 + OperandCount(instruction->op);
+	if (instruction->op == OP_CLOSURE) {
+		length += 2 * UpvalueCount(chunk, instruction);
+	}
+	return length;
+}
+
+static void MarkTargets(Program* program) {
+	for (int i = 0; i <= program->count; i++) {
+		program->code[i].is_target = false;
+	}
+	for (int i = 0; i < program->count; i++) {
+		Instruction* instruction = &program->code[i];
+		if (IsJump(instruction->op) && !instruction->is_dead) {
+			program->code[instruction->target].is_target = true;
+		}
+	}
+}
+
+static void Decode(Chunk* chunk, Program* program) {
+	// index of the instruction starting at each byte offset, the extra
+	// slot stands for the end of the chunk.
+	int* index_of = ALLOCATE(int, chunk->count + 1);
+	program->code = ALLOCATE(Instruction, chunk->count + 1);
+	program->count = 0;
+	program->source = chunk->code;
+
+	for (int offset = 0; offset < chunk->count; ) {
+		Instruction* instruction = &program->code[program->count];
+		index_of[offset] = program->count++;
+		instruction->op = chunk->code[offset];
+		instruction->a = 0;
+		instruction->b = 0;
+		instruction->line = GetLine(chunk, offset);
+		instruction->target = -1;
+		instruction->source = offset;
+		instruction->is_target = false;
+		instruction->is_dead = false;
+		if (OperandCount(instruction->op) >= 1) instruction->a = chunk->code[offset + 1];
+		if (OperandCount(instruction->op) >= 2) instruction->b = chunk->code[offset + 2];
+		offset += EncodedLength(chunk, instruction);
+	}
+	index_of[chunk->count] = program->count;
+	// a sentinel instruction so jumps to the end of the chunk
+	// have something to point at.
+	program->code[program->count].op = OP_RETURN;
+	program->code[program->count].source = chunk->count;
+	program->code[program->count].is_dead = false;
+
+	for (int i = 0; i < program->count; i++) {
+		Instruction* instruction = &program->code[i];
+		if (!IsJump(instruction->op)) continue;
+		int jump = (instruction->a << 8) | instruction->b;
+		int next = instruction->source + 3;
+		int target = instruction->op == OP_LOOP ? next - jump : next + jump;
+		instruction->target = index_of[target];
+	}
+	MarkTargets(program);
+
+	FREE_ARRAY(int, index_of, chunk->count + 1);
+}
+
+// drops dead instructions, jumps into removed code move on to
+// the next live instruction.
+static void Compact(Program* program) {
+	int* index_of = ALLOCATE(int, program->count + 1);
+	int count = 0;
+	for (int i = 0; i < program->count; i++) {
+		index_of[i] = count;
+		if (!program->code[i].is_dead) {
+			program->code[count++] = program->code[i];
+		}
+	}
+	index_of[program->count] = count;
+	program->code[count] = program->code[program->count];
+
+	for (int i = 0; i < count; i++) {
+		Instruction* instruction = &program->code[i];
+		if (IsJump(instruction->op)) {
+			instruction->target = index_of[instruction->target];
+		}
+	}
+	FREE_ARRAY(int, index_of, program->count + 1);
+	program->count = count;
+	MarkTargets(program);
+}
+
+static void Encode(Chunk* chunk, Program* program) {
+	int* offset_of = ALLOCATE(int, program->count + 1);
+	int length = 0;
+	for (int i = 0; i < program->count; i++) {
+		offset_of[i] = length;
+		length += EncodedLength(chunk, &program->code[i]);
+	}
+	offset_of[program->count] = length;
+
+	uint8_t* code = ALLOCATE(uint8_t, length);
+	// instructions are only merged or dropped, so the new line table
+	// never needs more runs than the old one.
+	chunk->line_count = 0;
+	for (int i = 0; i < program->count; i++) {
+		Instruction* instruction = &program->code[i];
+		int offset = offset_of[i];
+		int size = EncodedLength(chunk, instruction);
+		code[offset] = instruction->op;
+		AddLine(chunk, offset, instruction->line);
+		if (IsJump(instruction->op)) {
+			int next = offset + 3;
+			int target = offset_of[instruction->target];
+			int jump = instruction->op == OP_LOOP ? next - target : target - next;
+			code[offset + 1] = (jump >> 8) & 0xff;
+			code[offset + 2] = jump & 0xff;
+		}
+		else if (instruction->op == OP_CLOSURE) {
+			code[offset + 1] = instruction->a;
+			memcpy(&code[offset + 2],
+				&program->source[instruction->source + 2], size - 2);
+		}
+		else {
+			if (size > 1) code[offset + 1] = instruction->a;
+			if (size > 2) code[offset + 2] = instruction->b;
+		}
+	}
+
+	chunk->lines = GROW_ARRAY(LineStart, chunk->lines,
+		chunk->line_capacity, chunk->line_count);
+	chunk->line_capacity = chunk->line_count;
+	FREE_ARRAY(uint8_t, chunk->code, chunk->capaciy);
+	chunk->code = code;
+	chunk->count = length;
+	chunk->capaciy = length;
+	FREE_ARRAY(int, offset_of, program->count + 1);
+}
+
+// true when the count instructions from start can be replaced by one:
+// nothing may jump into the middle of them.
+static bool CanFuse(Program* program, int start, int count) {
+	if (start + count > program->count) return false;
+	for (int i = start + 1; i < start + count; i++) {
+		if (program->code[i].is_target) return false;
+	}
+	return true;
+}
+
+// the value an instruction pushes when it only loads a constant.
+static bool ConstantValue(Chunk* chunk, const Instruction* instruction, Value* value) {
+	switch (instruction->op) {
+	case OP_CONSTANT: *value = chunk->constants.values[instruction->a]; return true;
+	case OP_NIL: *value = NIL_VAL; return true;
+	case OP_TRUE: *value = BOOL_VAL(true); return true;
+	case OP_FALSE: *value = BOOL_VAL(false); return true;
+	default: return false;
+	}
+}
+
+// rewrites the instruction to push value, false when the
+// constant table has no room left.
+static bool LoadConstant(Chunk* chunk, Instruction* instruction, Value value) {
+	if (IS_NIL(value)) {
+		instruction->op = OP_NIL;
+		return true;
+	}
+	if (IS_BOOL(value)) {
+		instruction->op = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+		return true;
+	}
+	// folding often lands on a value the chunk already holds.
+	int index = FindConstant(chunk, value);
+	if (index == -1) {
+		if (chunk->constants.count > UINT8_MAX) return false;
+		index = AddConstant(chunk, value);
+	}
+	instruction->op = OP_CONSTANT;
+	instruction->a = (uint8_t)index;
+	return true;
+}
+
+static bool IsFalseyConstant(Value value) {
+	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static bool FoldUnary(uint8_t op, Value operand, Value* result) {
+	switch (op) {
+	case OP_NOT:
+		*result = BOOL_VAL(IsFalseyConstant(operand));
+		return true;
+	case OP_NEGATE:
+		if (!IS_NUMBER(operand)) return false;
+		*result = NUMBER_VAL(-AS_NUMBER(operand));
+		return true;
+	default:
+		return false;
+	}
+}
+
+// only folds what cannot fail at runtime, string concatenation
+// and mistyped operands are left for the VM.
+static bool FoldBinary(uint8_t op, Value a, Value b, Value* result) {
+	if (op == OP_EQUAL) {
+		*result = BOOL_VAL(ValuesEqual(a, b));
+		return true;
+	}
+	if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+	double x = AS_NUMBER(a);
+	double y = AS_NUMBER(b);
+	switch (op) {
+	case OP_ADD: *result = NUMBER_VAL(x + y); return true;
+	case OP_SUBTRACT: *result = NUMBER_VAL(x - y); return true;
+	case OP_MULTIPLY: *result = NUMBER_VAL(x * y); return true;
+	case OP_DIVIDE: *result = NUMBER_VAL(x / y); return true;
+	case OP_GREATER: *result = BOOL_VAL(x > y); return true;
+	case OP_LESS: *result = BOOL_VAL(x < y); return true;
+	default: return false;
+	}
+}
+
+static bool FoldConstants(Chunk* chunk, Program* program) {
+	Instruction* code = program->code;
+	bool changed = false;
+	for (int i = 0; i < program->count; i++) {
+		Value a, b, result;
+		if (!ConstantValue(chunk, &code[i], &a)) continue;
+
+		if (CanFuse(program, i, 2) &&
+			FoldUnary(code[i + 1].op, a, &result) &&
+			LoadConstant(chunk, &code[i], result)) {
+			code[i + 1].is_dead = true;
+			changed = true;
+			i += 1;
+		}
+		else if (CanFuse(program, i, 3) &&
+			ConstantValue(chunk, &code[i + 1], &b) &&
+			FoldBinary(code[i + 2].op, a, b, &result) &&
+			LoadConstant(chunk, &code[i], result)) {
+			code[i + 1].is_dead = true;
+			code[i + 2].is_dead = true;
+			changed = true;
+			i += 2;
+		}
+	}
+	Compact(program);
+	return changed;
+}
+
+static bool IsPureLoad(uint8_t op) {
+	switch (op) {
+	case OP_CONSTANT:
+	case OP_NIL:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_GET_LOCAL:
+	case OP_GET_UPVALUE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// branches on constants, NOT before a branch whose condition is
+// popped on both edges, and values pushed only to be popped.
+static bool Peephole(Chunk* chunk, Program* program) {
+	Instruction* code = program->code;
+	bool changed = false;
+	for (int i = 0; i < program->count; i++) {
+		Instruction* first = &code[i];
+		Value value;
+		if (first->is_dead || !CanFuse(program, i, 2)) continue;
+		Instruction* second = &code[i + 1];
+
+		if (second->op == OP_JUMP_IF_FALSE &&
+			ConstantValue(chunk, first, &value)) {
+			// the condition stays on the stack either way.
+			if (IsFalseyConstant(value)) {
+				second->op = OP_JUMP;
+			}
+			else {
+				second->is_dead = true;
+			}
+			changed = true;
+		}
+		else if (first->op == OP_NOT && second->op == OP_JUMP_IF_FALSE &&
+			code[i + 2].op == OP_POP && code[second->target].op == OP_POP) {
+			first->is_dead = true;
+			second->op = OP_JUMP_IF_TRUE;
+			changed = true;
+		}
+	}
+	Compact(program);
+
+	for (int i = 0; i < program->count; i++) {
+		if (IsPureLoad(code[i].op) && CanFuse(program, i, 2) &&
+			code[i + 1].op == OP_POP) {
+			code[i].is_dead = true;
+			code[i + 1].is_dead = true;
+			changed = true;
+			i += 1;
+		}
+	}
+	Compact(program);
+	return changed;
+}
+
+// points jumps that land on an unconditional jump at its target.
+static bool ThreadJumps(Program* program) {
+	Instruction* code = program->code;
+	bool changed = false;
+	for (int i = 0; i < program->count; i++) {
+		Instruction* jump = &code[i];
+		if (!IsJump(jump->op)) continue;
+
+		int target = jump->target;
+		// the hop limit ends chains that loop forever.
+		for (int hops = 0; hops < program->count &&
+			IsUnconditionalJump(code[target].op); hops++) {
+			int next = code[target].target;
+			if (next == target) break;
+			// conditional jumps can only go forward.
+			if (!IsUnconditionalJump(jump->op) && next <= i) break;
+			// code only shrinks, so the new offset is no larger than
+			// the distance between the original instructions.
+			int distance = code[next].source - jump->source;
+			if (distance < 0) distance = -distance;
+			if (distance + 3 > UINT16_MAX) break;
+			target = next;
+		}
+		if (target != jump->target) changed = true;
+		jump->target = target;
+		if (IsUnconditionalJump(jump->op)) {
+			jump->op = target > i ? OP_JUMP : OP_LOOP;
+		}
+	}
+	MarkTargets(program);
+	return changed;
+}
+
+// drops code no jump lands on after an unconditional jump or a
+// return, and jumps to the very next instruction. a branch that
+// pops its operands still has to pop them, so it becomes a pop.
+static bool RemoveUnreachable(Program* program) {
+	Instruction* code = program->code;
+	bool changed = false;
+	bool reachable = true;
+	for (int i = 0; i < program->count; i++) {
+		Instruction* instruction = &code[i];
+		if (instruction->is_target) reachable = true;
+		if (!reachable) {
+			instruction->is_dead = true;
+			changed = true;
+			continue;
+		}
+		if (IsJump(instruction->op) && instruction->target == i + 1) {
+			int popped = PoppedByJump(instruction->op);
+			if (popped == 0) {
+				instruction->is_dead = true;
+			}
+			else if (popped == 1) {
+				instruction->op = OP_POP;
+			}
+			else {
+				instruction->op = OP_POPN;
+				instruction->a = (uint8_t)popped;
+			}
+			changed = true;
+			continue;
+		}
+		if (IsUnconditionalJump(instruction->op) ||
+			instruction->op == OP_RETURN) {
+			reachable = false;
+		}
+	}
+	Compact(program);
+	return changed;
+}
+
+// turns runs of OP_POP, such as the ones left at the end of a
+// scope, into a single OP_POPN.
+static void MergePops(Program* program) {
+	Instruction* code = program->code;
+	for (int i = 0; i < program->count; i++) {
+		if (code[i].op != OP_POP) continue;
+		int count = 1;
+		while (count < UINT8_MAX && CanFuse(program, i, count + 1) &&
+			code[i + count].op == OP_POP) {
+			code[i + count].is_dead = true;
+			count++;
+		}
+		if (count > 1) {
+			code[i].op = OP_POPN;
+			code[i].a = (uint8_t)count;
+		}
+		i += count - 1;
+	}
+	Compact(program);
+}
+
+// the opcode that pops the operands of compare and branches like
+// jump, the plain pop-and-branch when compare is no comparison.
+static uint8_t CompareJumpFor(uint8_t compare, uint8_t jump) {
+	bool if_false = jump == OP_JUMP_IF_FALSE;
+	switch (compare) {
+	case OP_LESS: return if_false ? OP_JUMP_IF_NOT_LESS : OP_JUMP_IF_LESS;
+	case OP_GREATER: return if_false ? OP_JUMP_IF_NOT_GREATER : OP_JUMP_IF_GREATER;
+	case OP_EQUAL: return if_false ? OP_JUMP_IF_NOT_EQUAL : OP_JUMP_IF_EQUAL;
+	default: return if_false ? OP_POP_JUMP_IF_FALSE : OP_POP_JUMP_IF_TRUE;
+	}
+}
+
+// a condition is branched on and then popped on both edges, the
+// branch can pop it instead and land past the pop at its target.
+// a comparison right before it is folded into the branch too.
+static void FuseBranches(Program* program) {
+	Instruction* code = program->code;
+	for (int i = 0; i < program->count; i++) {
+		Instruction* jump = &code[i];
+		if (jump->op != OP_JUMP_IF_FALSE && jump->op != OP_JUMP_IF_TRUE) continue;
+		if (!CanFuse(program, i, 2) || code[i + 1].op != OP_POP ||
+			code[jump->target].op != OP_POP) continue;
+
+		uint8_t fused = CompareJumpFor(OP_POP, jump->op);
+		if (i > 0 && !code[i - 1].is_dead && CanFuse(program, i - 1, 2)) {
+			fused = CompareJumpFor(code[i - 1].op, jump->op);
+		}
+		if (fused != CompareJumpFor(OP_POP, jump->op)) {
+			code[i - 1].op = fused;
+			code[i - 1].target = jump->target + 1;
+			jump->is_dead = true;
+		}
+		else {
+			jump->op = fused;
+			jump->target += 1;
+		}
+		code[i + 1].is_dead = true;
+		i += 1;
+	}
+	Compact(program);
+}
+
+static uint8_t ConstantOperatorFor(uint8_t op) {
+	switch (op) {
+	case OP_ADD: return OP_ADD_CONSTANT;
+	case OP_SUBTRACT: return OP_SUBTRACT_CONSTANT;
+	case OP_LESS: return OP_LESS_CONSTANT;
+	default: return OP_CONSTANT;
+	}
+}
+
+// replaces the hottest opcode sequences, as reported by
+// DEBUG_PROFILE_OPCODES, with a single superinstruction.
+static void FuseSuperinstructions(Program* program) {
+	Instruction* code = program->code;
+	for (int i = 0; i < program->count; i++) {
+		Instruction* first = &code[i];
+		if (first->is_dead) continue;
+
+		if (first->op == OP_GET_LOCAL && CanFuse(program, i, 3) &&
+			code[i + 1].op == OP_GET_LOCAL && code[i + 2].op == OP_ADD) {
+			first->op = OP_ADD_LOCALS;
+			first->b = code[i + 1].a;
+			code[i + 1].is_dead = true;
+			code[i + 2].is_dead = true;
+			i += 2;
+		}
+		else if (first->op == OP_CONSTANT && CanFuse(program, i, 2) &&
+			ConstantOperatorFor(code[i + 1].op) != OP_CONSTANT) {
+			first->op = ConstantOperatorFor(code[i + 1].op);
+			code[i + 1].is_dead = true;
+			i += 1;
+		}
+		else if (first->op == OP_SET_LOCAL && CanFuse(program, i, 2) &&
+			code[i + 1].op == OP_POP) {
+			first->op = OP_SET_LOCAL_POP;
+			code[i + 1].is_dead = true;
+			i += 1;
+		}
+	}
+	Compact(program);
+}
+
+// how much the instruction changes the stack height, peak is set to
+// how far above the starting height it reaches while it runs.
+static int StackEffect(const Instruction* instruction, int* peak) {
+	*peak = 0;
+	switch (instruction->op) {
+	case OP_CONSTANT:
+	case OP_NIL:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_CLOSURE:
+	case OP_GET_LOCAL:
+	case OP_GET_UPVALUE:
+	case OP_GET_GLOBAL:
+		*peak = 1;
+		return 1;
+	case OP_ADD_LOCALS:
+		// concatenation pushes both operands.
+		*peak = 2;
+		return 1;
+	case OP_ADD_CONSTANT:
+		// concatenation pushes the constant.
+		*peak = 1;
+		return 0;
+	case OP_CALL:
+	case OP_TAIL_CALL:
+	case OP_POPN:
+		return -instruction->a;
+	case OP_JUMP_IF_LESS:
+	case OP_JUMP_IF_NOT_LESS:
+	case OP_JUMP_IF_GREATER:
+	case OP_JUMP_IF_NOT_GREATER:
+	case OP_JUMP_IF_EQUAL:
+	case OP_JUMP_IF_NOT_EQUAL:
+		return -2;
+	case OP_PRINT:
+	case OP_RETURN:
+	case OP_CLOSE_UPVALUE:
+	case OP_POP:
+	case OP_DEFINE_GLOBAL:
+	case OP_EQUAL:
+	case OP_GREATER:
+	case OP_LESS:
+	case OP_ADD:
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_SET_LOCAL_POP:
+	case OP_POP_JUMP_IF_FALSE:
+	case OP_POP_JUMP_IF_TRUE:
+		return -1;
+	default:
+		return 0;
+	}
+}
+
+// sets the height on entry to an instruction, the first path that
+// reaches it decides and later ones must agree.
+static bool EnterAt(int* height, int index, int value, bool* valid) {
+	if (height[index] >= 0) {
+		if (height[index] != value) *valid = false;
+		return false;
+	}
+	height[index] = value;
+	return true;
+}
+
+// the highest the stack gets above the function's arguments. the
+// compiler leaves the same height on every path into an instruction,
+// valid is cleared for code that does not, that pops below lowest or
+// that runs off the end of the chunk.
+static int MaxStackHeight(Program* program, int lowest, bool* valid) {
+	int* height = ALLOCATE(int, program->count + 1);
+	for (int i = 0; i <= program->count; i++) {
+		height[i] = -1;
+	}
+	height[0] = 0;
+	*valid = true;
+
+	int max = 0;
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (int i = 0; i < program->count; i++) {
+			if (height[i] < 0) continue;
+			Instruction* instruction = &program->code[i];
+			int peak;
+			int after = height[i] + StackEffect(instruction, &peak);
+			if (height[i] + peak > max) max = height[i] + peak;
+			if (after < lowest) *valid = false;
+
+			if (IsJump(instruction->op)) {
+				changed |= EnterAt(height, instruction->target, after, valid);
+			}
+			if (!IsUnconditionalJump(instruction->op) && instruction->op != OP_RETURN) {
+				EnterAt(height, i + 1, after, valid);
+			}
+		}
+	}
+	// the sentinel past the last instruction is never run.
+	if (height[program->count] >= 0) *valid = false;
+	FREE_ARRAY(int, height, program->count + 1);
+	return max;
+}
+
+void OptimizeChunk(Chunk* chunk)
+{
+	if (chunk->count == 0) return;
+
+	Program program;
+	int capacity = chunk->count + 1;
+	Decode(chunk, &program);
+	// each pass can expose work for the others, e.g. a folded
+	// condition turns its branch into dead code.
+	bool changed;
+	do {
+		changed = FoldConstants(chunk, &program);
+		changed |= Peephole(chunk, &program);
+		changed |= ThreadJumps(&program);
+		changed |= RemoveUnreachable(&program);
+	} while (changed);
+	FuseBranches(&program);
+	// the pops the branches now skip may be left unreachable.
+	while (RemoveUnreachable(&program));
+	FuseSuperinstructions(&program);
+	MergePops(&program);
+	// the compiler's own code, there is nothing to check.
+	bool valid;
+	chunk->max_stack = MaxStackHeight(&program, INT_MIN, &valid);
+	Encode(chunk, &program);
+	FREE_ARRAY(Instruction, program.code, capacity);
+}
+
+// checks the operands of an instruction against what the function
+// has, slot_count is how many stack slots its frame may use.
+static bool CheckOperands(const Chunk* chunk, int offset, int slot_count,
+	int upvalue_count, int global_count) {
+	uint8_t op = chunk->code[offset];
+	uint8_t a = OperandCount(op) >= 1 ? chunk->code[offset + 1] : 0;
+	uint8_t b = OperandCount(op) >= 2 ? chunk->code[offset + 2] : 0;
+	switch (op) {
+	case OP_CONSTANT:
+	case OP_ADD_CONSTANT:
+	case OP_SUBTRACT_CONSTANT:
+	case OP_LESS_CONSTANT:
+		return a < chunk->constants.count;
+	case OP_CLOSURE: {
+		ObjFunction* function = AS_FUNCTION(chunk->constants.values[a]);
+		for (int i = 0; i < function->upvalue_count; i++) {
+			uint8_t is_local = chunk->code[offset + 2 + 2 * i];
+			uint8_t index = chunk->code[offset + 3 + 2 * i];
+			if (index >= (is_local ? slot_count : upvalue_count)) return false;
+		}
+		return true;
+	}
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+	case OP_SET_LOCAL_POP:
+		return a < slot_count;
+	case OP_ADD_LOCALS:
+		return a < slot_count && b < slot_count;
+	case OP_GET_UPVALUE:
+	case OP_SET_UPVALUE:
+		return a < upvalue_count;
+	case OP_DEFINE_GLOBAL:
+	case OP_GET_GLOBAL:
+	case OP_SET_GLOBAL:
+		return ((a << 8) | b) < global_count;
+	default:
+		return true;
+	}
+}
+
+#define OFFSET_START 1
+#define OFFSET_TARGET 2
+
+bool VerifyChunk(Chunk* chunk, int arity, int upvalue_count, int global_count)
+{
+	// no instruction reaches more than two above the height it starts
+	// at, and the height never grows around a loop.
+	if (chunk->max_stack < 0 || chunk->max_stack > 2 * chunk->count + 2) return false;
+	// the closure, its arguments and what the code pushes above them.
+	int slot_count = arity + 1 + chunk->max_stack;
+
+	// what each byte offset is, jump targets must start an instruction.
+	uint8_t* offsets = ALLOCATE(uint8_t, chunk->count + 1);
+	memset(offsets, 0, chunk->count + 1);
+	offsets[chunk->count] = OFFSET_START;
+	bool ok = true;
+	for (int offset = 0; ok && offset < chunk->count; ) {
+		uint8_t op = chunk->code[offset];
+		offsets[offset] |= OFFSET_START;
+		// OP_POP_JUMP_IF_TRUE is the last opcode.
+		int length = 1 + OperandCount(op);
+		ok = op <= OP_POP_JUMP_IF_TRUE && length <= chunk->count - offset;
+		if (ok && op == OP_CLOSURE) {
+			uint8_t index = chunk->code[offset + 1];
+			ok = index < chunk->constants.count && IS_FUNCTION(chunk->constants.values[index]);
+			if (ok) length += 2 * AS_FUNCTION(chunk->constants.values[index])->upvalue_count;
+			ok = ok && length <= chunk->count - offset;
+		}
+		ok = ok && CheckOperands(chunk, offset, slot_count, upvalue_count, global_count);
+		if (ok && IsJump(op)) {
+			int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+			int next = offset + 3;
+			int target = op == OP_LOOP ? next - jump : next + jump;
+			ok = target >= 0 && target <= chunk->count;
+			if (ok) offsets[target] |= OFFSET_TARGET;
+		}
+		offset += length;
+	}
+	for (int i = 0; ok && i < chunk->count; i++) {
+		ok = offsets[i] != OFFSET_TARGET;
+	}
+	FREE_ARRAY(uint8_t, offsets, chunk->count + 1);
+	if (!ok) return false;
+
+	// well formed now, so it decodes like the compiler's own code.
+	Program program;
+	Decode(chunk, &program);
+	// scopes pop the arguments too, but never the frame below them.
+	bool valid;
+	int max_stack = MaxStackHeight(&program, -(arity + 1), &valid);
+	FREE_ARRAY(Instruction, program.code, chunk->count + 1);
+	return valid && max_stack == chunk->max_stack;
+}
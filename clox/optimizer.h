@@ -0,0 +1,12 @@
+#ifndef CLOX_OPTIMIZER_H
+#define CLOX_OPTIMIZER_H
+
+#include "chunk.h"
+
+void OptimizeChunk(Chunk* chunk);
+// true when the chunk is safe to run: known opcodes, operands in
+// range, jumps onto instructions and max_stack the height the code
+// reaches. for code that did not come from the compiler.
+bool VerifyChunk(Chunk* chunk, int arity, int upvalue_count, int global_count);
+
+#endif // !CLOX_OPTIMIZER_H
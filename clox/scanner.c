@@ -1,20 +1,107 @@
 #include "scanner.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 
+// SSE2 is part of x86-64, so only AVX2 depends on the compiler flags.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SCANNER_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#define SCANNER_AVX2
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER) && defined(SCANNER_SSE2)
+#include <intrin.h>
+#endif
+
 Scanner scanner;
 
-void InitScanner(const char* source) {
+// streamed sources are read in blocks of at least this size, a block
+// grows when a single token does not fit.
+#define STREAM_BLOCK (64 * 1024)
+
+void InitScanner(const char* source, size_t length) {
 	scanner.start = source;
 	scanner.current = source;
+	scanner.end = source + length;
 	scanner.line = 1;
+	scanner.stream = NULL;
+	scanner.first_block = NULL;
+	scanner.last_block = NULL;
+}
+void ResumeScanner(const char* source, const char* end, int line) {
+	InitScanner(source, end - source);
+	scanner.line = line;
+}
+void InitStreamScanner(FILE* stream) {
+	InitScanner("", 0);
+	scanner.stream = stream;
+}
+bool CanReleaseSource() {
+	return scanner.first_block != scanner.last_block;
+}
+void ReleaseSource(const char* keep) {
+	while (scanner.first_block != scanner.last_block) {
+		SourceBlock* block = scanner.first_block;
+		if (keep >= block->chars && keep <= block->chars + block->capacity) break;
+		scanner.first_block = block->next;
+		free(block);
+	}
+}
+void FreeScanner() {
+	while (scanner.first_block != NULL) {
+		SourceBlock* block = scanner.first_block;
+		scanner.first_block = block->next;
+		free(block);
+	}
+	InitScanner("", 0);
+}
+
+static SourceBlock* NewBlock(size_t capacity) {
+	SourceBlock* block = (SourceBlock*)malloc(sizeof(SourceBlock) + capacity);
+	if (block == NULL) {
+		fprintf(stderr, "not enough memory to read the source.\n");
+		exit(74);
+	}
+	block->next = NULL;
+	block->capacity = capacity;
+	if (scanner.last_block == NULL) scanner.first_block = block;
+	else scanner.last_block->next = block;
+	scanner.last_block = block;
+	return block;
+}
+// reads on from the stream until needed characters follow current,
+// false when the stream ends first.
+static bool Refill(size_t needed) {
+	if (scanner.stream == NULL) return false;
+	while ((size_t)(scanner.end - scanner.current) < needed) {
+		SourceBlock* block = scanner.last_block;
+		if (block == NULL || scanner.end == block->chars + block->capacity) {
+			// the token being scanned moves to the new block whole.
+			size_t kept = (size_t)(scanner.end - scanner.start);
+			size_t capacity = STREAM_BLOCK;
+			while (capacity < kept * 2) capacity *= 2;
+			block = NewBlock(capacity);
+			memcpy(block->chars, scanner.start, kept);
+			scanner.current = block->chars + (scanner.current - scanner.start);
+			scanner.start = block->chars;
+			scanner.end = block->chars + kept;
+		}
+		size_t used = (size_t)(scanner.end - block->chars);
+		size_t read = fread(block->chars + used, 1, block->capacity - used, scanner.stream);
+		if (read == 0) return false;
+		scanner.end += read;
+	}
+	return true;
 }
 
 static bool IsAtEnd() {
-	return (*scanner.current == '\0');
+	return scanner.current >= scanner.end && !Refill(1);
 }
 static char Advance() {
 	return *scanner.current++;
@@ -25,10 +112,11 @@ static bool Match(char expected) {
 	return true;
 }
 static char Peek() {
-	return *scanner.current;
+	return IsAtEnd() ? '\0' : *scanner.current;
 }
 static char PeekNext() {
-	return IsAtEnd()? '\0' : scanner.current[1];
+	if (scanner.end - scanner.current < 2 && !Refill(2)) return '\0';
+	return scanner.current[1];
 }
 static bool IsDigit(char c) {
 	return (c >= '0' && c <= '9');
@@ -38,14 +126,184 @@ static bool IsAlpha(char c) {
 		(c >= 'A' && c <= 'Z') ||
 		c == '_');
 }
-static TokenType CheckKeyword(
-	int start, int length, const char* rest, TokenType type) {
-	if (scanner.current - scanner.start == start + length &&
-		memcmp(scanner.start + start, rest, length) == 0) {
-		return type;
+// the fast paths below look at 16 or 32 bytes at a time, and only at
+// whole blocks before end. the rest, and anything a stream has yet to
+// read, is left to the scalar loops that call them.
+#ifdef SCANNER_SSE2
+static int FirstBit(unsigned mask) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif // _MSC_VER
+}
+static int CountBits(unsigned mask) {
+	int count = 0;
+	for (; mask != 0; mask &= mask - 1) count++;
+	return count;
+}
+// bytes in [low, high], the signed compares leave out non-ASCII bytes.
+static __m128i InRange(__m128i chars, char low, char high) {
+	return _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8(low - 1)),
+		_mm_cmpgt_epi8(_mm_set1_epi8(high + 1), chars));
+}
+#endif // SCANNER_SSE2
+
+static const char* SkipDigits(const char* p, const char* end) {
+#ifdef SCANNER_SSE2
+	for (; end - p >= 16; p += 16) {
+		__m128i chars = _mm_loadu_si128((const __m128i*)p);
+		unsigned other = ~(unsigned)_mm_movemask_epi8(InRange(chars, '0', '9')) & 0xffff;
+		if (other != 0) return p + FirstBit(other);
 	}
-	return TOKEN_IDENTIFIER;
+#endif // SCANNER_SSE2
+	while (p < end && IsDigit(*p)) p++;
+	return p;
+}
+static const char* SkipIdentifierChars(const char* p, const char* end) {
+#ifdef SCANNER_SSE2
+	for (; end - p >= 16; p += 16) {
+		__m128i chars = _mm_loadu_si128((const __m128i*)p);
+		__m128i lower = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+		__m128i word = _mm_or_si128(
+			_mm_or_si128(InRange(lower, 'a', 'z'), InRange(chars, '0', '9')),
+			_mm_cmpeq_epi8(chars, _mm_set1_epi8('_')));
+		unsigned other = ~(unsigned)_mm_movemask_epi8(word) & 0xffff;
+		if (other != 0) return p + FirstBit(other);
+	}
+#endif // SCANNER_SSE2
+	while (p < end && (IsAlpha(*p) || IsDigit(*p))) p++;
+	return p;
+}
+static bool IsBlank(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
 }
+// skips spaces, tabs and newlines, counting the newlines.
+static const char* SkipBlanks(const char* p, const char* end, int* line) {
+	// most runs between tokens are a single space.
+	if (end - p >= 2 && !IsBlank(p[1])) {
+		if (*p == '\n') (*line)++;
+		return p + 1;
+	}
+#ifdef SCANNER_SSE2
+	for (; end - p >= 16; p += 16) {
+		__m128i chars = _mm_loadu_si128((const __m128i*)p);
+		__m128i newlines = _mm_cmpeq_epi8(chars, _mm_set1_epi8('\n'));
+		__m128i blanks = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8(' ')), newlines),
+			_mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8('\t')),
+				_mm_cmpeq_epi8(chars, _mm_set1_epi8('\r'))));
+		unsigned newline_mask = (unsigned)_mm_movemask_epi8(newlines);
+		unsigned other = ~(unsigned)_mm_movemask_epi8(blanks) & 0xffff;
+		if (other != 0) {
+			int length = FirstBit(other);
+			*line += CountBits(newline_mask & ((1u << length) - 1));
+			return p + length;
+		}
+		*line += CountBits(newline_mask);
+	}
+#endif // SCANNER_SSE2
+	for (; p < end && IsBlank(*p); p++) {
+		if (*p == '\n') (*line)++;
+	}
+	return p;
+}
+// the first newline at or after p, or end.
+static const char* FindNewline(const char* p, const char* end) {
+#ifdef SCANNER_AVX2
+	for (; end - p >= 32; p += 32) {
+		__m256i chars = _mm256_loadu_si256((const __m256i*)p);
+		unsigned found = (unsigned)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\n')));
+		if (found != 0) return p + FirstBit(found);
+	}
+#endif // SCANNER_AVX2
+#ifdef SCANNER_SSE2
+	for (; end - p >= 16; p += 16) {
+		__m128i chars = _mm_loadu_si128((const __m128i*)p);
+		unsigned found = (unsigned)_mm_movemask_epi8(
+			_mm_cmpeq_epi8(chars, _mm_set1_epi8('\n')));
+		if (found != 0) return p + FirstBit(found);
+	}
+#endif // SCANNER_SSE2
+	while (p < end && *p != '\n') p++;
+	return p;
+}
+// the closing quote of a string at or after p, or end, counting the
+// newlines inside the string.
+static const char* FindQuote(const char* p, const char* end, int* line) {
+#ifdef SCANNER_AVX2
+	for (; end - p >= 32; p += 32) {
+		__m256i chars = _mm256_loadu_si256((const __m256i*)p);
+		unsigned quotes = (unsigned)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('"')));
+		unsigned newlines = (unsigned)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\n')));
+		if (quotes != 0) {
+			int length = FirstBit(quotes);
+			*line += CountBits(newlines & ((1u << length) - 1));
+			return p + length;
+		}
+		*line += CountBits(newlines);
+	}
+#endif // SCANNER_AVX2
+#ifdef SCANNER_SSE2
+	for (; end - p >= 16; p += 16) {
+		__m128i chars = _mm_loadu_si128((const __m128i*)p);
+		unsigned quotes = (unsigned)_mm_movemask_epi8(
+			_mm_cmpeq_epi8(chars, _mm_set1_epi8('"')));
+		unsigned newlines = (unsigned)_mm_movemask_epi8(
+			_mm_cmpeq_epi8(chars, _mm_set1_epi8('\n')));
+		if (quotes != 0) {
+			int length = FirstBit(quotes);
+			*line += CountBits(newlines & ((1u << length) - 1));
+			return p + length;
+		}
+		*line += CountBits(newlines);
+	}
+#endif // SCANNER_SSE2
+	for (; p < end && *p != '"'; p++) {
+		if (*p == '\n') (*line)++;
+	}
+	return p;
+}
+
+typedef struct {
+	const char* name;
+	int length;
+	TokenType type;
+} Keyword;
+
+// keywords are found by a perfect hash of an identifier's length and
+// its first and last characters, then confirmed with one compare. a new
+// keyword needs only a line below, unless its slot is taken (GCC warns
+// with -Woverride-init), then the multiplier or the table has to change.
+#define KEYWORD_SLOTS 32
+#define KEYWORD_HASH(length, first, last) \
+	(((unsigned)(length) + (unsigned)(first) + 5u * (unsigned)(last)) & (KEYWORD_SLOTS - 1))
+#define KEYWORD(name, first, last, type) \
+	[KEYWORD_HASH(sizeof(name) - 1, first, last)] = { name, sizeof(name) - 1, type }
+
+static const Keyword keywords[KEYWORD_SLOTS] = {
+	KEYWORD("and", 'a', 'd', TOKEN_AND),
+	KEYWORD("class", 'c', 's', TOKEN_CLASS),
+	KEYWORD("else", 'e', 'e', TOKEN_ELSE),
+	KEYWORD("false", 'f', 'e', TOKEN_FALSE),
+	KEYWORD("for", 'f', 'r', TOKEN_FOR),
+	KEYWORD("fun", 'f', 'n', TOKEN_FUN),
+	KEYWORD("if", 'i', 'f', TOKEN_IF),
+	KEYWORD("nil", 'n', 'l', TOKEN_NIL),
+	KEYWORD("or", 'o', 'r', TOKEN_OR),
+	KEYWORD("print", 'p', 't', TOKEN_PRINT),
+	KEYWORD("return", 'r', 'n', TOKEN_RETURN),
+	KEYWORD("super", 's', 'r', TOKEN_SUPER),
+	KEYWORD("this", 't', 's', TOKEN_THIS),
+	KEYWORD("true", 't', 'e', TOKEN_TRUE),
+	KEYWORD("var", 'v', 'r', TOKEN_VAR),
+	KEYWORD("while", 'w', 'e', TOKEN_WHILE),
+};
 
 static Token MakeToken(TokenType type) {
 	Token token;
@@ -64,40 +322,17 @@ static Token ErrorToken(const char* message) {
 	return token;
 }
 static TokenType identifierType() {
-	switch (scanner.start[0]) {
-	case 'a': return CheckKeyword(1, 2, "nd", TOKEN_AND);
-	case 'c': return CheckKeyword(1, 4, "lass", TOKEN_CLASS);
-	case 'e': return CheckKeyword(1, 3, "lse", TOKEN_ELSE);
-	case 'f': {
-		if (scanner.current - scanner.start > 1) {
-			switch (scanner.start[1]) {
-			case 'a': return CheckKeyword(2, 3, "lse", TOKEN_FALSE);
-			case 'o': return CheckKeyword(2, 1, "r", TOKEN_FOR);
-			case 'u': return CheckKeyword(2, 1, "n", TOKEN_FUN);
-			default: break;
-			}
-		}
-	}
-	case 'i': return CheckKeyword(1, 1, "f", TOKEN_IF);
-	case 'n': return CheckKeyword(1, 2, "il", TOKEN_NIL);
-	case 'o': return CheckKeyword(1, 1, "r", TOKEN_OR);
-	case 'p': return CheckKeyword(1, 4, "rint", TOKEN_PRINT);
-	case 'r': return CheckKeyword(1, 5, "eturn", TOKEN_RETURN);
-	case 's': return CheckKeyword(1, 4, "uper", TOKEN_SUPER);
-	case 't': {
-		switch (scanner.start[1]) {
-		case 'h': return CheckKeyword(2, 2, "is", TOKEN_THIS);
-		case 'r': return CheckKeyword(2, 2, "ue", TOKEN_TRUE);
-		default: break;
-		}
-	case 'v': return CheckKeyword(1, 2, "ar", TOKEN_VAR);
-	case 'w': return CheckKeyword(1, 4, "hile", TOKEN_WHILE);
-	default: break;
-	}
+	int length = (int)(scanner.current - scanner.start);
+	const Keyword* keyword = &keywords[
+		KEYWORD_HASH(length, scanner.start[0], scanner.start[length - 1])];
+	if (keyword->length == length &&
+		memcmp(keyword->name, scanner.start, length) == 0) {
+		return keyword->type;
 	}
 	return TOKEN_IDENTIFIER;
 }
 static Token String() {
+	scanner.current = FindQuote(scanner.current, scanner.end, &scanner.line);
 	while (Peek() != '"' && !IsAtEnd()) {
 		if (Peek() == '\n') scanner.line++;
 		Advance();
@@ -107,33 +342,39 @@ static Token String() {
 	return MakeToken(TOKEN_STRING);
 }
 static Token Number() {
+	if (IsDigit(Peek())) scanner.current = SkipDigits(scanner.current, scanner.end);
 	while (IsDigit(Peek())) Advance();
 
 	if (Peek() == '.' && IsDigit(PeekNext())) {
 		Advance();
+		scanner.current = SkipDigits(scanner.current, scanner.end);
 		while (IsDigit(Peek())) Advance();
 	}
 	return MakeToken(TOKEN_NUMBER);
 }
 static Token Identifier() {
+	// the vector loop only pays off past the first character.
+	if (IsAlpha(Peek()) || IsDigit(Peek())) {
+		scanner.current = SkipIdentifierChars(scanner.current, scanner.end);
+	}
 	while (IsAlpha(Peek()) || IsDigit(Peek())) Advance();
 	return MakeToken(identifierType());
 }
 static void SkipWhitespace() {
 	for (;;) {
+		// nothing skipped needs to move when a stream refills.
+		scanner.start = scanner.current;
 		char c = Peek();
 		switch (c) {
 		case ' ':
 		case '\t':
 		case '\r':
-			Advance();
-			break;
 		case '\n':
-			scanner.line++;
-			Advance();
+			scanner.current = SkipBlanks(scanner.current, scanner.end, &scanner.line);
 			break;
 		case '/':
 			if (PeekNext() == '/') {
+				scanner.current = FindNewline(scanner.current, scanner.end);
 				while (Peek() != '\n' && !IsAtEnd()) Advance();
 			}
 			else {
@@ -1,10 +1,30 @@
 #ifndef CLOC_SCANNER_H
 #define CLOC_SCANNER_H
 
+#include <stddef.h>
+#include <stdio.h>
+
+#include "common.h"
+
+// a streamed source is read into a list of blocks. a token never
+// spans two blocks, and a block stays put until ReleaseSource(), so
+// tokens can point into it like into a whole source.
+typedef struct SourceBlock {
+	struct SourceBlock* next;
+	size_t capacity;
+	char chars[];
+} SourceBlock;
+
 typedef struct {
 	const char* start;
 	const char* current;
+	// the source is not NUL terminated, scanning stops here.
+	const char* end;
 	int line;
+	// NULL unless the source is streamed.
+	FILE* stream;
+	SourceBlock* first_block;
+	SourceBlock* last_block;
 } Scanner;
 
 typedef enum {
@@ -36,7 +56,15 @@ typedef struct {
 	int line;
 } Token;
 
-void InitScanner(const char* source);
+void InitScanner(const char* source, size_t length);
+// scans on from the middle of a source.
+void ResumeScanner(const char* source, const char* end, int line);
+void InitStreamScanner(FILE* stream);
+// true once a stream has moved past its first block.
+bool CanReleaseSource();
+// frees the streamed blocks that lie wholly before keep.
+void ReleaseSource(const char* keep);
+void FreeScanner();
 Token ScanToken();
 
 #endif // !CLOC_SCANNER_H
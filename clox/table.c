@@ -1,64 +1,216 @@
 #include "table.h"
 
+#include <stdio.h>
 #include <string.h>
 
 #include "memory.h"
+#include "vm.h"
 
-#define TABLE_MAX_LOAD (0.75)
+// SSE2 is part of x86-64, other targets match a group byte by byte.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TABLE_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER) && defined(TABLE_SSE2)
+#include <intrin.h>
+#endif
 
-static Entry* FindEntry(Entry* entries, int capacity, ObjString* key) {
-	uint32_t index = key->hash % capacity;
-	Entry* tombstone = NULL;
-	for (;;) {
-		Entry* entry = &entries[index];
-		if (entry->key == NULL) {
-			if (IS_NIL(entry->value)) {
-				return (tombstone == NULL) ? entry : tombstone;
-			}
-			else {
-				if (tombstone == NULL) {
-					tombstone = entry;
-				}
-			}
-		} else if (entry->key == key) {
-			return entry;
+#define TABLE_MAX_LOAD (0.875)
+// a full table with no more keys than this rehashes in place to drop
+// its tombstones instead of growing.
+#define TABLE_DROP_LOAD (0.5)
+
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xfe
+// full slots keep the low seven bits of the hash, the rest picks the
+// first group to probe.
+#define HASH_TAG(hash) ((uint8_t)((hash) & 0x7f))
+#define HASH_GROUP(hash) ((hash) >> 7)
+
+#ifdef TABLE_SSE2
+static int FirstBit(unsigned mask) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif // _MSC_VER
+}
+#else
+static int FirstBit(unsigned mask) {
+	int index = 0;
+	for (; (mask & 1) == 0; mask >>= 1) index++;
+	return index;
+}
+#endif // TABLE_SSE2
+
+// bit i is set when control byte i of the group is byte.
+static unsigned MatchByte(const uint8_t* group, uint8_t byte) {
+#ifdef TABLE_SSE2
+	__m128i bytes = _mm_loadu_si128((const __m128i*)group);
+	return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)byte)));
+#else
+	unsigned mask = 0;
+	for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+		if (group[i] == byte) mask |= 1u << i;
+	}
+	return mask;
+#endif // TABLE_SSE2
+}
+// bit i is set when slot i of the group is empty or deleted, the only
+// control bytes with the high bit set.
+static unsigned MatchFree(const uint8_t* group) {
+#ifdef TABLE_SSE2
+	return (unsigned)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+	unsigned mask = 0;
+	for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+		if (group[i] & 0x80) mask |= 1u << i;
+	}
+	return mask;
+#endif // TABLE_SSE2
+}
+
+static size_t TableBytes(int capacity) {
+	return (size_t)capacity * (sizeof(uint8_t) + sizeof(ObjString*) + sizeof(Value));
+}
+
+// groups are probed at triangular offsets, which visits every group
+// of a power of two sized table. a group with an empty slot ends the
+// probe, no key was ever placed past it.
+static int FindKey(const Table* table, ObjString* key) {
+	uint32_t mask = (uint32_t)table->capacity / TABLE_GROUP_SIZE - 1;
+	uint32_t group = HASH_GROUP(key->hash) & mask;
+	for (uint32_t step = 1;; step++) {
+		const uint8_t* control = table->control + group * TABLE_GROUP_SIZE;
+		for (unsigned match = MatchByte(control, HASH_TAG(key->hash));
+			match != 0; match &= match - 1) {
+			int index = (int)group * TABLE_GROUP_SIZE + FirstBit(match);
+			if (table->keys[index] == key) return index;
 		}
-		index = (index + 1) % capacity;
+		if (MatchByte(control, CONTROL_EMPTY) != 0) return -1;
+		group = (group + step) & mask;
 	}
 }
-static void AdjustCapacity(Table* table, int capacity) {
-	Entry* entries = ALLOCATE(Entry, capacity);
-	for (int i = 0; i < capacity; i++) {
-		entries[i].key = NULL;
-		entries[i].value = NIL_VAL;
+// the first empty or deleted slot on the probe sequence of hash.
+static int FindFree(const uint8_t* control, int capacity, uint32_t hash) {
+	uint32_t mask = (uint32_t)capacity / TABLE_GROUP_SIZE - 1;
+	uint32_t group = HASH_GROUP(hash) & mask;
+	for (uint32_t step = 1;; step++) {
+		unsigned slots = MatchFree(control + group * TABLE_GROUP_SIZE);
+		if (slots != 0) return (int)group * TABLE_GROUP_SIZE + FirstBit(slots);
+		group = (group + step) & mask;
 	}
+}
+static void AdjustCapacity(Table* table, int capacity) {
+	uint8_t* control = ALLOCATE(uint8_t, TableBytes(capacity));
+	ObjString** keys = (ObjString**)(control + capacity);
+	Value* values = (Value*)(keys + capacity);
+	memset(control, CONTROL_EMPTY, capacity);
 
 	table->count = 0;
+	table->tombstones = 0;
 	for (int i = 0; i < table->capacity; i++) {
-		Entry* entry = &table->entries[i];
-		if (entry->key != NULL) {
-			Entry* dest = FindEntry(entries, capacity, entry->key);
-			dest->key = entry->key;
-			dest->value = entry->value;
-			table->count++;
-		}
+		if (table->control[i] & 0x80) continue;
+		ObjString* key = table->keys[i];
+		int index = FindFree(control, capacity, key->hash);
+		control[index] = HASH_TAG(key->hash);
+		keys[index] = key;
+		values[index] = table->values[i];
+		table->count++;
 	}
 
-	FREE_ARRAY(Entry, table->entries, table->capacity);
+	FREE_ARRAY(uint8_t, table->control, TableBytes(table->capacity));
 	table->capacity = capacity;
-	table->entries = entries;
+	table->control = control;
+	table->keys = keys;
+	table->values = values;
+}
+// a slot whose group still has an empty one never made a probe go
+// on, so it can be empty again instead of deleted.
+static void DeleteSlot(Table* table, int index) {
+	const uint8_t* group = table->control + index / TABLE_GROUP_SIZE * TABLE_GROUP_SIZE;
+	if (MatchByte(group, CONTROL_EMPTY) != 0) {
+		table->control[index] = CONTROL_EMPTY;
+	}
+	else {
+		table->control[index] = CONTROL_DELETED;
+		table->tombstones++;
+	}
+	table->count--;
+	table->keys[index] = NULL;
+	table->values[index] = NIL_VAL;
+}
+// rehashes without allocating. full slots are marked deleted while
+// they wait to be placed, and old tombstones become empty.
+static void DropTombstones(Table* table) {
+	uint8_t* control = table->control;
+	for (int i = 0; i < table->capacity; i++) {
+		control[i] = (control[i] & 0x80) ? CONTROL_EMPTY : CONTROL_DELETED;
+	}
+
+	for (int i = 0; i < table->capacity; i++) {
+		if (control[i] != CONTROL_DELETED) continue;
+		ObjString* key = table->keys[i];
+		int target = FindFree(control, table->capacity, key->hash);
+		// no group before this one has room, so the key can stay.
+		if (target / TABLE_GROUP_SIZE == i / TABLE_GROUP_SIZE) {
+			control[i] = HASH_TAG(key->hash);
+			continue;
+		}
+
+		Value value = table->values[i];
+		bool was_empty = control[target] == CONTROL_EMPTY;
+		control[target] = HASH_TAG(key->hash);
+		if (was_empty) {
+			control[i] = CONTROL_EMPTY;
+			table->keys[i] = NULL;
+			table->values[i] = NIL_VAL;
+		}
+		else {
+			// the target held a key still waiting, place it next.
+			table->keys[i] = table->keys[target];
+			table->values[i] = table->values[target];
+			i--;
+		}
+		table->keys[target] = key;
+		table->values[target] = value;
+	}
+	table->tombstones = 0;
+}
+// called before an insert that would go past the maximum load.
+static void MakeRoom(Table* table) {
+	if (table->capacity == 0 || table->count + 1 > table->capacity * TABLE_DROP_LOAD) {
+		int capacity = table->capacity < TABLE_GROUP_SIZE ?
+			TABLE_GROUP_SIZE : table->capacity * 2;
+		AdjustCapacity(table, capacity);
+	}
+	else {
+		DropTombstones(table);
+	}
+}
+// deleting never allocates, it runs inside the collector. a table
+// left mostly empty shrinks on its next insert instead.
+static void Shrink(Table* table) {
+	int capacity = TABLE_GROUP_SIZE;
+	while (table->count + 1 > capacity * TABLE_MAX_LOAD / 2) capacity *= 2;
+	AdjustCapacity(table, capacity);
 }
 
 void InitTable(Table* table)
 {
 	table->capacity = 0;
 	table->count = 0;
-	table->entries = NULL;
+	table->tombstones = 0;
+	table->control = NULL;
+	table->keys = NULL;
+	table->values = NULL;
 }
 
 void FreeTable(Table* table)
 {
-	FREE_ARRAY(Entry, table->entries, table->capacity);
+	FREE_ARRAY(uint8_t, table->control, TableBytes(table->capacity));
 	InitTable(table);
 }
 
@@ -67,27 +219,36 @@ bool TableGet(Table* table, ObjString* key, Value* value)
 	if (table->count == 0) {
 		return false;
 	}
-	Entry* entry = FindEntry(table->entries, table->capacity, key);
-	if (entry->key == NULL) {
+	int index = FindKey(table, key);
+	if (index == -1) {
 		return false;
 	}
-	*value = entry->value;
+	*value = table->values[index];
 	return true;
 }
 
 bool TableSet(Table* table, ObjString* key, Value value)
 {
-	if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-		int capacity = GROW_CAPACITY(table->capacity);
-		AdjustCapacity(table, capacity);
+	int index = table->count == 0 ? -1 : FindKey(table, key);
+	bool is_new = (index == -1);
+	if (is_new) {
+		if (table->count + table->tombstones + 1 > table->capacity * TABLE_MAX_LOAD) {
+			MakeRoom(table);
+		}
+		else if (table->capacity > TABLE_GROUP_SIZE &&
+			table->count < table->capacity / 8) {
+			Shrink(table);
+		}
+		index = FindFree(table->control, table->capacity, key->hash);
+		if (table->control[index] == CONTROL_DELETED) table->tombstones--;
+		table->control[index] = HASH_TAG(key->hash);
+		table->count++;
 	}
 
-	Entry* entry = FindEntry(table->entries, table->capacity, key);
-	bool is_new = (entry->key == NULL);
-	if (is_new && IS_NIL(entry->value)) table->count++;
-
-	entry->key = key;
-	entry->value = value;
+	WRITE_BARRIER(OBJ_VAL(key));
+	WRITE_BARRIER(value);
+	table->keys[index] = key;
+	table->values[index] = value;
 	return is_new;
 }
 
@@ -97,21 +258,19 @@ bool TableDelete(Table* table, ObjString* key)
 		return false;
 	}
 
-	Entry* entry = FindEntry(table->entries, table->capacity, key);
-	if (entry->key == NULL) {
+	int index = FindKey(table, key);
+	if (index == -1) {
 		return false;
 	}
-	entry->key = NULL;
-	entry->value = BOOL_VAL(true);
+	DeleteSlot(table, index);
 	return true;
 }
 
 void TableAddAll(Table* dest, Table* src)
 {
 	for (int i = 0; i < src->capacity; i++) {
-		Entry* entry = &src->entries[i];
-		if (entry->key != NULL) {
-			TableSet(dest, entry->key, entry->value);
+		if (!(src->control[i] & 0x80)) {
+			TableSet(dest, src->keys[i], src->values[i]);
 		}
 	}
 }
@@ -122,20 +281,73 @@ ObjString* TableFindString(Table* table, const char* src, int length, uint32_t h
 		return NULL;
 	}
 
-	uint32_t index = hash % table->capacity;
-	for (;;) {
-		Entry* entry = &table->entries[index];
-		if (entry->key == NULL) {
-			if (IS_NIL(entry->value)) {
-				return NULL;
+	uint32_t mask = (uint32_t)table->capacity / TABLE_GROUP_SIZE - 1;
+	uint32_t group = HASH_GROUP(hash) & mask;
+	for (uint32_t step = 1;; step++) {
+		const uint8_t* control = table->control + group * TABLE_GROUP_SIZE;
+		for (unsigned match = MatchByte(control, HASH_TAG(hash));
+			match != 0; match &= match - 1) {
+			ObjString* key = table->keys[group * TABLE_GROUP_SIZE + FirstBit(match)];
+			if (key->hash == hash && key->length == length &&
+				memcmp(key->str, src, length) == 0) {
+				return key;
 			}
 		}
-		else if (entry->key->length == length &&
-			entry->key->hash == hash &&
-			memcmp(entry->key->str, src, length) == 0) {
-			return entry->key;
+		if (MatchByte(control, CONTROL_EMPTY) != 0) return NULL;
+		group = (group + step) & mask;
+	}
+}
+
+void MarkTable(Table* table)
+{
+	for (int i = 0; i < table->capacity; i++) {
+		if (!(table->control[i] & 0x80)) {
+			MarkObject((Obj*)table->keys[i]);
+			MarkValue(table->values[i]);
 		}
-		index = (index + 1) % table->capacity;
 	}
-	return NULL;
+}
+
+void TableRemoveWhite(Table* table)
+{
+	for (int i = 0; i < table->capacity; i++) {
+		if (!(table->control[i] & 0x80) && !table->keys[i]->obj.is_marked) {
+			DeleteSlot(table, i);
+		}
+	}
+}
+
+void GetTableStats(const Table* table, TableStats* stats)
+{
+	stats->count = table->count;
+	stats->tombstones = table->tombstones;
+	stats->capacity = table->capacity;
+	stats->average_probe = 0;
+	stats->max_probe = 0;
+
+	long total = 0;
+	uint32_t mask = (uint32_t)table->capacity / TABLE_GROUP_SIZE - 1;
+	for (int i = 0; i < table->capacity; i++) {
+		if (table->control[i] & 0x80) continue;
+		uint32_t group = HASH_GROUP(table->keys[i]->hash) & mask;
+		int probe = 1;
+		for (uint32_t step = 1; group != (uint32_t)i / TABLE_GROUP_SIZE; step++) {
+			group = (group + step) & mask;
+			probe++;
+		}
+		total += probe;
+		if (probe > stats->max_probe) stats->max_probe = probe;
+	}
+	if (table->count > 0) {
+		stats->average_probe = (double)total / table->count;
+	}
+}
+
+void PrintTableStats(const char* name, const Table* table)
+{
+	TableStats stats;
+	GetTableStats(table, &stats);
+	printf("%s: %d keys, %d tombstones, %d slots, probe avg %.2f max %d\n",
+		name, stats.count, stats.tombstones, stats.capacity,
+		stats.average_probe, stats.max_probe);
 }
@@ -3,17 +3,32 @@
 
 #include "object.h"
 
-typedef struct {
-	ObjString* key;
-	Value value;
-} Entry;
+// slots come in groups of TABLE_GROUP_SIZE, and every slot has a
+// control byte that is empty, deleted, or a tag of its key's hash.
+// a probe compares a whole group of control bytes at once and only
+// looks at the keys whose tag matches.
+#define TABLE_GROUP_SIZE 16
 
 typedef struct {
 	int count;
+	int tombstones;
+	// zero or a power of two no smaller than a group.
 	int capacity;
-	Entry* entries;
+	// one allocation holds control, then keys, then values.
+	uint8_t* control;
+	ObjString** keys;
+	Value* values;
 } Table;
 
+typedef struct {
+	int count;
+	int tombstones;
+	int capacity;
+	// groups looked at to find a key, 1 when it is in its first group.
+	double average_probe;
+	int max_probe;
+} TableStats;
+
 
 void InitTable(Table* table);
 void FreeTable(Table* table);
@@ -23,5 +38,9 @@ bool TableDelete(Table* table, ObjString* key);
 void TableAddAll(Table* dest, Table* src);
 ObjString* TableFindString(Table* table,
 	const char* src, int length, uint32_t hash);
+void MarkTable(Table* table);
+void TableRemoveWhite(Table* table);
+void GetTableStats(const Table* table, TableStats* stats);
+void PrintTableStats(const char* name, const Table* table);
 
 #endif // !CLOX_TABLE_H
@@ -8,14 +8,26 @@
 
 bool ValuesEqual(Value a, Value b)
 {
+#ifdef NAN_BOXING
+	// compare numbers as doubles so that NaN != NaN and 0 == -0.
+	if (IS_NUMBER(a) && IS_NUMBER(b)) {
+		return AS_NUMBER(a) == AS_NUMBER(b);
+	}
+	if (a == b) return true;
+	return IS_STRING(a) && IS_STRING(b) && StringsEqual(AS_STRING(a), AS_STRING(b));
+#else
 	if (a.type != b.type) return false;
 	switch (a.type) {
 	case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
 	case VAL_NIL: return true;
-	case VAL_NUMBER: return AS_NUMBER(a) = AS_NUMBER(b);
-	case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+	case VAL_UNDEFINED: return true;
+	case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
+	case VAL_OBJ:
+		return AS_OBJ(a) == AS_OBJ(b) ||
+			(IS_STRING(a) && IS_STRING(b) && StringsEqual(AS_STRING(a), AS_STRING(b)));
 	default: return false;  // unreachable
 	}
+#endif // NAN_BOXING
 }
 
 void InitValueArray(ValueArray* array)
@@ -45,10 +57,26 @@ void FreeValueArray(ValueArray* array)
 
 void PrintValue(Value value)
 {
+#ifdef NAN_BOXING
+	if (IS_BOOL(value)) {
+		printf(AS_BOOL(value) ? "true" : "false");
+	}
+	else if (IS_NIL(value)) {
+		printf("nil");
+	}
+	else if (IS_NUMBER(value)) {
+		printf("%g", AS_NUMBER(value));
+	}
+	else if (IS_OBJ(value)) {
+		PrintObject(value);
+	}
+#else
 	switch (value.type) {
 	case VAL_BOOL: printf(AS_BOOL(value) ? "true" : "false"); break;
 	case VAL_NIL: printf("nil"); break;
 	case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
 	case VAL_OBJ: PrintObject(value); break;
+	case VAL_UNDEFINED: printf("undefined"); break;
 	}
+#endif // NAN_BOXING
 }
@@ -2,6 +2,7 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
@@ -13,14 +14,18 @@
 
 
 
+#define TRACE_FRAMES 10
+
 VM vm;
-InterpretResult Run();
+static InterpretResult Run();
 static bool Call(ObjClosure* function, int arg_count);
+static void CloseUpvalues(Value* last);
 
 static void ResetStack() {
 	vm.stack_top = vm.stack;
 	vm.frame_count = 0;
-	vm.open_upvalues = NULL;
+	memset(vm.open_upvalues, 0, sizeof(ObjUpvalue*) * vm.open_upvalue_top);
+	vm.open_upvalue_top = 0;
 }
 static void RuntimeError(const char* fmt, ...) {
 	va_list args;
@@ -30,10 +35,16 @@ static void RuntimeError(const char* fmt, ...) {
 	fputs("\n", stderr);
 
 	for (int i = vm.frame_count - 1; i >= 0; i--) {
+		// deep recursion only shows the frames at both ends.
+		if (i == vm.frame_count - 1 - TRACE_FRAMES && i >= 2 * TRACE_FRAMES) {
+			fprintf(stderr, "... %d more frames\n", i - TRACE_FRAMES + 1);
+			i = TRACE_FRAMES;
+			continue;
+		}
 		CallFrame* frame = &vm.frames[i];
 		ObjFunction* function = frame->closure->function;
 		size_t index = frame->ip - frame->closure->function->chunk.code - 1;
-		fprintf(stderr, "[line %d] in ", function->chunk.lines[index]);
+		fprintf(stderr, "[line %d] in ", GetLine(&function->chunk, (int)index));
 		if (function->name == NULL) {
 			fprintf(stderr, "script\n");
 		}
@@ -47,26 +58,78 @@ static void RuntimeError(const char* fmt, ...) {
 static void DefineNative(const char* name, NativeFn function) {
 	PushStack(OBJ_VAL(CopyString(name, (int)strlen(name))));
 	PushStack(OBJ_VAL(NewNative(function)));
-	TableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+	int slot = ResolveGlobal(AS_STRING(vm.stack[0]));
+	vm.global_values.values[slot] = vm.stack[1];
 	PopStack();
 	PopStack();
 }
 static Value ClockNative(int arg_count, Value* args) {
 	return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
+static Value GcPauseNative(int arg_count, Value* args) {
+	if (arg_count != 1 || !IS_NUMBER(args[0])) return NIL_VAL;
+	return NUMBER_VAL(GcPausePercentile(AS_NUMBER(args[0])));
+}
+static Value GcHeapNative(int arg_count, Value* args) {
+	return NUMBER_VAL((double)vm.bytes_allocated);
+}
 void InitVM() {
+	vm.frame_capacity = FRAMES_INITIAL;
+	vm.frame_max = FRAME_MAX;
+	vm.frames = (CallFrame*)malloc(sizeof(CallFrame) * vm.frame_capacity);
+	vm.stack_capacity = STACK_INITIAL;
+	vm.stack_max = STACK_MAX;
+	vm.stack = (Value*)malloc(sizeof(Value) * vm.stack_capacity);
+	vm.open_upvalues = (ObjUpvalue**)calloc(vm.stack_capacity, sizeof(ObjUpvalue*));
+	vm.open_upvalue_top = 0;
+	if (vm.frames == NULL || vm.stack == NULL || vm.open_upvalues == NULL) exit(1);
 	ResetStack();
-	InitTable(&vm.globals);
+	InitTable(&vm.global_slots);
+	InitValueArray(&vm.global_values);
+	InitValueArray(&vm.global_names);
 	InitTable(&vm.strings);
 	vm.obj_head = NULL;
 
+	vm.bytes_allocated = 0;
+	vm.next_gc = 1024 * 1024;
+	vm.gray_count = 0;
+	vm.gray_capacity = 0;
+	vm.gray_stack = NULL;
+
+	vm.gc_phase = GC_PHASE_IDLE;
+	vm.gc_debt = 0;
+	vm.gc_pause_budget = GC_PAUSE_BUDGET_NS;
+	vm.sweep_list = NULL;
+	vm.swept = false;
+	memset(&vm.gc_pauses, 0, sizeof(vm.gc_pauses));
+
 	DefineNative("clock", ClockNative);
+	DefineNative("gcPause", GcPauseNative);
+	DefineNative("gcHeap", GcHeapNative);
 }
 
 void FreeVM() {
-	FreeTable(&vm.globals);
+#ifdef DEBUG_LOG_GC
+	PrintGcPauses();
+#endif // DEBUG_LOG_GC
+#ifdef DEBUG_PROFILE_OPCODES
+	PrintOpcodeProfile();
+#endif // DEBUG_PROFILE_OPCODES
+#ifdef DEBUG_TABLE_STATS
+	PrintTableStats("strings", &vm.strings);
+	PrintTableStats("globals", &vm.global_slots);
+#endif // DEBUG_TABLE_STATS
+	FreeTable(&vm.global_slots);
+	FreeValueArray(&vm.global_values);
+	FreeValueArray(&vm.global_names);
 	FreeTable(&vm.strings);
 	FreeObjects();
+	free(vm.frames);
+	free(vm.stack);
+	free(vm.open_upvalues);
+	vm.frames = NULL;
+	vm.stack = NULL;
+	vm.open_upvalues = NULL;
 }
 
 /*
@@ -76,27 +139,49 @@ InterpretResult Interpret(Chunk* chunk) {
 	return Run();
 }
 */
-InterpretResult Interpret(const char* source)
+InterpretResult Interpret(const char* source, size_t length)
 {
 	Chunk chunk;
 	InitChunk(&chunk);
 
-	ObjFunction* function = Compile(source);
+	ObjFunction* function = Compile(source, length);
 	if (function == NULL) {
 		return INTERPRET_COMPILE_ERROR;
 	}
+	return InterpretFunction(function);
+}
 
+static InterpretResult RunFunction(ObjFunction* function)
+{
 	PushStack(OBJ_VAL(function));
 	ObjClosure* closure = NewClosure(function);
 	PopStack();
 	PushStack(OBJ_VAL(closure));
-	Call(closure, 0);
+	if (!Call(closure, 0)) {
+		return INTERPRET_RUNTIME_ERROR;
+	}
+	return Run();
+}
 
+InterpretResult InterpretFunction(ObjFunction* function)
+{
 	printf("\n\n");
-	return Run();
+	return RunFunction(function);
+}
+
+InterpretResult InterpretStream(FILE* stream)
+{
+	printf("\n\n");
+	return CompileStream(stream, RunFunction);
 }
 
 void PushStack(Value value) {
+	// Call() reserves STACK_RESERVE values for pushes made outside
+	// of Run(), running past them is a bug in the VM.
+	if (vm.stack_top == vm.stack + vm.stack_capacity) {
+		fprintf(stderr, "value stack overflow.\n");
+		exit(70);
+	}
 	*vm.stack_top = value;
 	vm.stack_top++;
 }
@@ -106,31 +191,116 @@ Value PopStack() {
 	return *vm.stack_top;
 }
 
+// returns the slot for a global name, appending an undefined
+// slot the first time the name is seen.
+int ResolveGlobal(ObjString* name) {
+	Value slot;
+	if (TableGet(&vm.global_slots, name, &slot)) {
+		return (int)AS_NUMBER(slot);
+	}
+	PushStack(OBJ_VAL(name));
+	int index = vm.global_values.count;
+	WriteValueArray(&vm.global_values, UNDEFINED_VAL);
+	WriteValueArray(&vm.global_names, OBJ_VAL(name));
+	TableSet(&vm.global_slots, name, NUMBER_VAL(index));
+	PopStack();
+	return index;
+}
+
 static Value PeekStack(int distance) {
 	return vm.stack_top[-1 - distance];
 }
 static bool IsFalsey(Value value) {
 	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
+// shorter results are copied and interned, longer ones are left as
+// ropes so appending in a loop does not copy the whole string each time.
+#define ROPE_MIN_LENGTH 64
+
 static void Concatenate() {
-	ObjString* b = AS_STRING(PopStack());
-	ObjString* a = AS_STRING(PopStack());
+	ObjString* b = AS_STRING(PeekStack(0));
+	ObjString* a = AS_STRING(PeekStack(1));
 	int length = a->length + b->length;
-	char* buffer = ALLOCATE(char, length + 1);
-	memcpy(buffer, a->str, a->length);
-	memcpy(buffer + a->length, b->str, b->length);
-	buffer[length] = '\0';
-
-	ObjString* result = TakeString(buffer, length);
+	ObjString* result;
+	if (length < ROPE_MIN_LENGTH) {
+		// no rope is this short, both halves are flat. CopyString()
+		// only allocates when the result is not interned yet.
+		char buffer[ROPE_MIN_LENGTH];
+		memcpy(buffer, a->str, a->length);
+		memcpy(buffer + a->length, b->str, b->length);
+		result = CopyString(buffer, length);
+	}
+	else {
+		result = NewRope(a, b);
+	}
+	PopStack();
+	PopStack();
 	PushStack(OBJ_VAL(result));
 }
+static bool GrowFrames() {
+	if (vm.frame_capacity >= vm.frame_max) return false;
+	int capacity = vm.frame_capacity * 2;
+	if (capacity > vm.frame_max) capacity = vm.frame_max;
+	CallFrame* frames = (CallFrame*)realloc(vm.frames, sizeof(CallFrame) * capacity);
+	if (frames == NULL) exit(1);
+	vm.frames = frames;
+	vm.frame_capacity = capacity;
+	return true;
+}
+// makes room for needed values above the stack top. the stack is
+// moved when it grows, so frame slots and open upvalues are
+// pointed at the new copy.
+static bool EnsureStack(int needed) {
+	int used = (int)(vm.stack_top - vm.stack);
+	if (used + needed <= vm.stack_capacity) return true;
+	if (used + needed > vm.stack_max) return false;
+
+	int capacity = vm.stack_capacity;
+	while (capacity < used + needed) capacity *= 2;
+	if (capacity > vm.stack_max) capacity = vm.stack_max;
+	Value* stack = (Value*)malloc(sizeof(Value) * capacity);
+	if (stack == NULL) exit(1);
+	memcpy(stack, vm.stack, sizeof(Value) * used);
+
+	for (int i = 0; i < vm.frame_count; i++) {
+		vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+	}
+	ObjUpvalue** open_upvalues = (ObjUpvalue**)realloc(
+		vm.open_upvalues, sizeof(ObjUpvalue*) * capacity);
+	if (open_upvalues == NULL) exit(1);
+	memset(open_upvalues + vm.stack_capacity, 0,
+		sizeof(ObjUpvalue*) * (capacity - vm.stack_capacity));
+	for (int i = 0; i < vm.open_upvalue_top; i++) {
+		if (open_upvalues[i] != NULL) open_upvalues[i]->location = stack + i;
+	}
+	vm.open_upvalues = open_upvalues;
+	free(vm.stack);
+	vm.stack = stack;
+	vm.stack_top = stack + used;
+	vm.stack_capacity = capacity;
+	return true;
+}
+#ifdef LAZY_COMPILE
+static bool CompileBody(ObjFunction* function) {
+	if (function->lazy == NULL) return true;
+	if (!CompileLazyFunction(function)) {
+		RuntimeError("could not compile %s().", function->name->str);
+		return false;
+	}
+	return true;
+}
+#endif // LAZY_COMPILE
 static bool Call(ObjClosure* closure, int arg_count) {
+#ifdef LAZY_COMPILE
+	if (!CompileBody(closure->function)) return false;
+#endif // LAZY_COMPILE
 	if (arg_count != closure->function->arity) {
 		RuntimeError("expect %d arguments but got %d.",
 			closure->function->arity, arg_count);
 		return false;
 	}
-	if (vm.frame_count == FRAME_MAX) {
+	if ((vm.frame_count == vm.frame_capacity && !GrowFrames()) ||
+		!EnsureStack(closure->function->chunk.max_stack + STACK_RESERVE)) {
 		RuntimeError("stack overflow.");
 		return false;
 	}
@@ -141,6 +311,31 @@ static bool Call(ObjClosure* closure, int arg_count) {
 	frame->slots = vm.stack_top - arg_count - 1;
 	return true;
 }
+// replaces the current frame with a call to closure, so calls in
+// tail position run in constant stack.
+static bool TailCall(ObjClosure* closure, int arg_count) {
+#ifdef LAZY_COMPILE
+	if (!CompileBody(closure->function)) return false;
+#endif // LAZY_COMPILE
+	if (arg_count != closure->function->arity) {
+		RuntimeError("expect %d arguments but got %d.",
+			closure->function->arity, arg_count);
+		return false;
+	}
+
+	CallFrame* frame = &vm.frames[vm.frame_count - 1];
+	Value* callee = vm.stack_top - arg_count - 1;
+	CloseUpvalues(frame->slots);
+	memmove(frame->slots, callee, sizeof(Value) * (arg_count + 1));
+	vm.stack_top = frame->slots + arg_count + 1;
+	if (!EnsureStack(closure->function->chunk.max_stack + STACK_RESERVE)) {
+		RuntimeError("stack overflow.");
+		return false;
+	}
+	frame->closure = closure;
+	frame->ip = closure->function->chunk.code;
+	return true;
+}
 static bool CallValue(Value value, int arg_count) {
 	if (IS_OBJ(value)) {
 		switch (OBJ_TYPE(value)) {
@@ -159,253 +354,517 @@ static bool CallValue(Value value, int arg_count) {
 	return false;
 }
 static ObjUpvalue* CaptureUpvalue(Value* local) {
-	ObjUpvalue* prev = NULL;
-	ObjUpvalue* upvalue = vm.open_upvalues;
-	while (upvalue != NULL && upvalue->location > local) {
-		prev = upvalue;
-		upvalue = upvalue->next;
-	}
-	if (upvalue != NULL && upvalue->location == local) {
-		return upvalue;
+	int slot = (int)(local - vm.stack);
+	if (vm.open_upvalues[slot] != NULL) {
+		return vm.open_upvalues[slot];
 	}
 	ObjUpvalue* captured_upvalue = NewUpvalue(local);
-	if (prev == NULL) {
-		vm.open_upvalues = captured_upvalue;
-	}
-	else {
-		prev->next = captured_upvalue;
+	vm.open_upvalues[slot] = captured_upvalue;
+	if (slot >= vm.open_upvalue_top) {
+		vm.open_upvalue_top = slot + 1;
 	}
 	return captured_upvalue;
 }
+// an upvalue is closed before the stack drops below its slot, so
+// open_upvalue_top never passes the stack top and this only scans
+// the slots of the frame being left, or none if it captured nothing.
 static void CloseUpvalues(Value* last) {
- 	while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last) {
-		ObjUpvalue* upvalue = vm.open_upvalues;
+	int first = (int)(last - vm.stack);
+	for (int i = first; i < vm.open_upvalue_top; i++) {
+		ObjUpvalue* upvalue = vm.open_upvalues[i];
+		if (upvalue == NULL) continue;
 		upvalue->closed = *upvalue->location;
+		WRITE_BARRIER(upvalue->closed);
 		upvalue->location = &upvalue->closed;
-		vm.open_upvalues = vm.open_upvalues->next;
+		vm.open_upvalues[i] = NULL;
+	}
+	if (first < vm.open_upvalue_top) {
+		vm.open_upvalue_top = first;
 	}
 }
 
+#ifdef DEBUG_TRACE_EXECUTION
+static void TraceExecution(Chunk* chunk, uint8_t* ip, Value* stack_top) {
+	printf("          ");
+	for (Value* slot = vm.stack; slot < stack_top; ++slot) {
+		printf("[");
+		PrintValue(*slot);
+		printf("]");
+	}
+	printf("\n");
+	DisassembleInstruction(chunk, (int)(ip - chunk->code));
+}
+#define TRACE_EXECUTION() \
+	TraceExecution(&frame->closure->function->chunk, ip, stack_top)
+#else
+#define TRACE_EXECUTION() ((void)0)
+#endif // DEBUG_TRACE_EXECUTION
+
+#ifdef DEBUG_PROFILE_OPCODES
+#define PROFILE_INSTRUCTION() ProfileInstruction(*ip)
+#else
+#define PROFILE_INSTRUCTION() ((void)0)
+#endif // DEBUG_PROFILE_OPCODES
+
+#if defined(COMPUTED_GOTO) && defined(__GNUC__) && !defined(__clang__)
+// stop gcc from cross-jumping the per-handler dispatches back into one.
+__attribute__((optimize("no-crossjumping")))
+#endif
 static InterpretResult Run() {
-	CallFrame* frame = &vm.frames[vm.frame_count - 1];
+	// the hot state of the current frame lives in locals. STORE_FRAME()
+	// writes it back before anything that may look at frame->ip or
+	// vm.stack_top: calls, allocations (a collection scans the stack)
+	// and runtime errors. LOAD_FRAME() picks up whatever frame is on top.
+	CallFrame* frame;
+	uint8_t* ip;
+	Value* slots;
+	Value* constants;
+	Value* stack_top = vm.stack_top;
 
-#define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define STORE_FRAME() \
+	do { \
+		frame->ip = ip; \
+		vm.stack_top = stack_top; \
+	} while (0)
+#define LOAD_FRAME() \
+	do { \
+		frame = &vm.frames[vm.frame_count - 1]; \
+		ip = frame->ip; \
+		slots = frame->slots; \
+		constants = frame->closure->function->chunk.constants.values; \
+	} while (0)
+#define RUNTIME_ERROR(...) \
+	do { \
+		STORE_FRAME(); \
+		RuntimeError(__VA_ARGS__); \
+		return INTERPRET_RUNTIME_ERROR; \
+	} while (0)
+
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define PUSH(value) (*stack_top++ = (value))
+#define POP() (*--stack_top)
+#define PEEK(distance) (stack_top[-1 - (distance)])
 #define BINARY_OP(ValueType, op) \
 	do { \
-		if (!IS_NUMBER(PeekStack(0)) || !IS_NUMBER(PeekStack(1))) { \
-			RuntimeError("operands must be numbers."); \
-			return INTERPRET_RUNTIME_ERROR; \
+		if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+			RUNTIME_ERROR("operands must be numbers."); \
+		} \
+		double b = AS_NUMBER(POP()); \
+		double a = AS_NUMBER(POP()); \
+		PUSH(ValueType(a op b)); \
+	} while (0)
+// pops both operands of a comparison and jumps when its
+// result equals when.
+#define COMPARE_JUMP(op, when) \
+	do { \
+		uint16_t offset = READ_SHORT(); \
+		if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+			RUNTIME_ERROR("operands must be numbers."); \
+		} \
+		double b = AS_NUMBER(POP()); \
+		double a = AS_NUMBER(POP()); \
+		if ((a op b) == when) ip += offset; \
+	} while (0)
+#define BINARY_OP_CONSTANT(ValueType, op) \
+	do { \
+		Value b = READ_CONSTANT(); \
+		if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(b)) { \
+			RUNTIME_ERROR("operands must be numbers."); \
 		} \
-		double b = AS_NUMBER(PopStack()); \
-		double a = AS_NUMBER(PopStack()); \
-		PushStack(ValueType(a op b)); \
+		PEEK(0) = ValueType(AS_NUMBER(PEEK(0)) op AS_NUMBER(b)); \
 	} while (0)
 
-	for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-		printf("          ");
-		for (Value* slot = vm.stack; slot < vm.stack_top; ++slot) {
-			printf("[");
-			PrintValue(*slot);
-			printf("]");
-		}
-		printf("\n");
-		DisassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
-#endif // DEBUG_TRACE_EXECUTION
+	LOAD_FRAME();
 
-		uint8_t instruction;
-		switch (instruction = READ_BYTE()) {
-		case OP_PRINT: {
-			PrintValue(PopStack());
+#ifdef COMPUTED_GOTO
+	// every handler jumps straight to the next one through this table,
+	// giving each opcode its own indirect branch to predict.
+	static void* dispatch_table[UINT8_COUNT] = {
+		[OP_CONSTANT] = &&DO_OP_CONSTANT,
+		[OP_NIL] = &&DO_OP_NIL,
+		[OP_TRUE] = &&DO_OP_TRUE,
+		[OP_FALSE] = &&DO_OP_FALSE,
+		[OP_PRINT] = &&DO_OP_PRINT,
+		[OP_RETURN] = &&DO_OP_RETURN,
+		[OP_CALL] = &&DO_OP_CALL,
+		[OP_TAIL_CALL] = &&DO_OP_TAIL_CALL,
+		[OP_CLOSURE] = &&DO_OP_CLOSURE,
+		[OP_CLOSE_UPVALUE] = &&DO_OP_CLOSE_UPVALUE,
+		[OP_LOOP] = &&DO_OP_LOOP,
+		[OP_JUMP] = &&DO_OP_JUMP,
+		[OP_JUMP_IF_FALSE] = &&DO_OP_JUMP_IF_FALSE,
+		[OP_JUMP_IF_TRUE] = &&DO_OP_JUMP_IF_TRUE,
+		[OP_POP] = &&DO_OP_POP,
+		[OP_POPN] = &&DO_OP_POPN,
+		[OP_DEFINE_GLOBAL] = &&DO_OP_DEFINE_GLOBAL,
+		[OP_GET_LOCAL] = &&DO_OP_GET_LOCAL,
+		[OP_SET_LOCAL] = &&DO_OP_SET_LOCAL,
+		[OP_GET_UPVALUE] = &&DO_OP_GET_UPVALUE,
+		[OP_SET_UPVALUE] = &&DO_OP_SET_UPVALUE,
+		[OP_GET_GLOBAL] = &&DO_OP_GET_GLOBAL,
+		[OP_SET_GLOBAL] = &&DO_OP_SET_GLOBAL,
+		[OP_NOT] = &&DO_OP_NOT,
+		[OP_NEGATE] = &&DO_OP_NEGATE,
+		[OP_EQUAL] = &&DO_OP_EQUAL,
+		[OP_GREATER] = &&DO_OP_GREATER,
+		[OP_LESS] = &&DO_OP_LESS,
+		[OP_ADD] = &&DO_OP_ADD,
+		[OP_SUBTRACT] = &&DO_OP_SUBTRACT,
+		[OP_MULTIPLY] = &&DO_OP_MULTIPLY,
+		[OP_DIVIDE] = &&DO_OP_DIVIDE,
+		[OP_ADD_CONSTANT] = &&DO_OP_ADD_CONSTANT,
+		[OP_SUBTRACT_CONSTANT] = &&DO_OP_SUBTRACT_CONSTANT,
+		[OP_LESS_CONSTANT] = &&DO_OP_LESS_CONSTANT,
+		[OP_SET_LOCAL_POP] = &&DO_OP_SET_LOCAL_POP,
+		[OP_ADD_LOCALS] = &&DO_OP_ADD_LOCALS,
+		[OP_JUMP_IF_LESS] = &&DO_OP_JUMP_IF_LESS,
+		[OP_JUMP_IF_NOT_LESS] = &&DO_OP_JUMP_IF_NOT_LESS,
+		[OP_JUMP_IF_GREATER] = &&DO_OP_JUMP_IF_GREATER,
+		[OP_JUMP_IF_NOT_GREATER] = &&DO_OP_JUMP_IF_NOT_GREATER,
+		[OP_JUMP_IF_EQUAL] = &&DO_OP_JUMP_IF_EQUAL,
+		[OP_JUMP_IF_NOT_EQUAL] = &&DO_OP_JUMP_IF_NOT_EQUAL,
+		[OP_POP_JUMP_IF_FALSE] = &&DO_OP_POP_JUMP_IF_FALSE,
+		[OP_POP_JUMP_IF_TRUE] = &&DO_OP_POP_JUMP_IF_TRUE,
+	};
+	// bytes that are no opcode are filled in once here. a range
+	// initializer would be overridden by every entry above, and the
+	// warnings for that would hide real collisions.
+	static bool dispatch_filled = false;
+	if (!dispatch_filled) {
+		for (int i = 0; i < UINT8_COUNT; i++) {
+			if (dispatch_table[i] == NULL) dispatch_table[i] = &&DO_UNKNOWN;
+		}
+		dispatch_filled = true;
+	}
+#define CASE(op) case op: DO_##op
+#define DISPATCH() \
+	do { \
+		TRACE_EXECUTION(); \
+		PROFILE_INSTRUCTION(); \
+		goto *dispatch_table[READ_BYTE()]; \
+	} while (0)
+#else
+#define CASE(op) case op
+#define DISPATCH() break
+#endif // COMPUTED_GOTO
+
+	for (;;) {
+		TRACE_EXECUTION();
+		PROFILE_INSTRUCTION();
+		switch (READ_BYTE()) {
+		CASE(OP_PRINT): {
+			PrintValue(POP());
 			printf("\n");
-			break;
+			DISPATCH();
 		}
-		case OP_RETURN: {
-			Value result = PopStack();
-			CloseUpvalues(frame->slots);
+		CASE(OP_RETURN): {
+			Value result = POP();
+			CloseUpvalues(slots);
 			vm.frame_count--;
 			if (vm.frame_count == 0) {
-				PopStack();
+				vm.stack_top = stack_top - 1;
 				return INTERPRET_OK;
 			}
 
-			vm.stack_top = frame->slots;
-			PushStack(result);
-			frame = &vm.frames[vm.frame_count - 1];
-			break;
+			stack_top = slots;
+			PUSH(result);
+			LOAD_FRAME();
+			DISPATCH();
 		}
-		case OP_CALL: {
+		CASE(OP_CALL): {
 			int arg_count = READ_BYTE();
-			if (!CallValue(PeekStack(arg_count), arg_count)) {
+			STORE_FRAME();
+			if (!CallValue(PEEK(arg_count), arg_count)) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			frame = &vm.frames[vm.frame_count - 1];
-			break;
+			stack_top = vm.stack_top;
+			LOAD_FRAME();
+			DISPATCH();
 		}
-		case OP_CLOSURE: {
+		CASE(OP_TAIL_CALL): {
+			int arg_count = READ_BYTE();
+			Value callee = PEEK(arg_count);
+			STORE_FRAME();
+			bool ok = IS_CLOSURE(callee)
+				? TailCall(AS_CLOSURE(callee), arg_count)
+				: CallValue(callee, arg_count);
+			if (!ok) {
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			stack_top = vm.stack_top;
+			LOAD_FRAME();
+			DISPATCH();
+		}
+		CASE(OP_CLOSURE): {
 			ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+			STORE_FRAME();
 			ObjClosure* closure = NewClosure(function);
-			PushStack(OBJ_VAL(closure));
+			PUSH(OBJ_VAL(closure));
+			vm.stack_top = stack_top;
 			for (int i = 0; i < closure->upvalue_count; i++) {
 				uint8_t is_local = READ_BYTE();
 				uint8_t index = READ_BYTE();
 				if (is_local) {
-					closure->upvalues[i] = CaptureUpvalue(frame->slots + index);
+					closure->upvalues[i] = CaptureUpvalue(slots + index);
 				}
 				else {
 					closure->upvalues[i] = frame->closure->upvalues[index];
 				}
+				WRITE_BARRIER(OBJ_VAL(closure->upvalues[i]));
 			}
-			break;
+			DISPATCH();
 		}
-		case OP_CLOSE_UPVALUE: {
-			CloseUpvalues(vm.stack_top - 1);
-			PopStack();
-			break;
+		CASE(OP_CLOSE_UPVALUE): {
+			CloseUpvalues(stack_top - 1);
+			stack_top--;
+			DISPATCH();
 		}
-		case OP_LOOP: {
+		CASE(OP_LOOP): {
 			uint16_t offset = READ_SHORT();
-			frame->ip -= offset;
-			break;
+			ip -= offset;
+			DISPATCH();
 		}
-		case OP_JUMP: {
+		CASE(OP_JUMP): {
 			uint16_t offset = READ_SHORT();
-			frame->ip += offset;
-			break;
+			ip += offset;
+			DISPATCH();
 		}
-		case OP_JUMP_IF_FALSE: {
+		CASE(OP_JUMP_IF_FALSE): {
 			uint16_t offset = READ_SHORT();
-			if (IsFalsey(PeekStack(0))) {
-				frame->ip += offset;
+			if (IsFalsey(PEEK(0))) {
+				ip += offset;
 			}
-			break;
-		}
-		case OP_POP: {
-			PopStack();
-			break;
-		}
-		case OP_DEFINE_GLOBAL: {
-			ObjString* name = READ_STRING();
-			// ensures the VM can still find the value if a garbage
-			// collection is triggered right in the middle of adding
-			// it to the hash table. Thats a distinct possibility
-			// since the hash table requires dynamic allocation
-			// when it resizes.
-			// ???
-			TableSet(&vm.globals, name, PeekStack(0));
-			PopStack();
-			break;
-		}
-		case OP_GET_LOCAL: {
+			DISPATCH();
+		}
+		CASE(OP_JUMP_IF_TRUE): {
+			uint16_t offset = READ_SHORT();
+			if (!IsFalsey(PEEK(0))) {
+				ip += offset;
+			}
+			DISPATCH();
+		}
+		CASE(OP_POP): {
+			stack_top--;
+			DISPATCH();
+		}
+		CASE(OP_POPN): {
+			stack_top -= READ_BYTE();
+			DISPATCH();
+		}
+		CASE(OP_DEFINE_GLOBAL): {
+			uint16_t slot = READ_SHORT();
+			vm.global_values.values[slot] = POP();
+			DISPATCH();
+		}
+		CASE(OP_GET_LOCAL): {
 			uint8_t slot = READ_BYTE();
-			PushStack(frame->slots[slot]);
-			break;
+			PUSH(slots[slot]);
+			DISPATCH();
 		}
-		case OP_SET_LOCAL: {
+		CASE(OP_SET_LOCAL): {
 			uint8_t slot = READ_BYTE();
-			frame->slots[slot] = PeekStack(0);
-			break;
+			slots[slot] = PEEK(0);
+			DISPATCH();
 		}
-		case OP_GET_UPVALUE: {
+		CASE(OP_GET_UPVALUE): {
 			uint8_t slot = READ_BYTE();
-			PushStack(*frame->closure->upvalues[slot]->location);
-			break;
+			PUSH(*frame->closure->upvalues[slot]->location);
+			DISPATCH();
 		}
-		case OP_SET_UPVALUE: {
+		CASE(OP_SET_UPVALUE): {
 			uint8_t slot = READ_BYTE();
-			*frame->closure->upvalues[slot]->location = PeekStack(0);
-			break;
-		}
-		case OP_GET_GLOBAL: {
-			ObjString* name = READ_STRING();
-			Value value;
-			if (!TableGet(&vm.globals, name, &value)) {
-				RuntimeError("undefined variable '%s'.", name->str);
-				return INTERPRET_RUNTIME_ERROR;
+			*frame->closure->upvalues[slot]->location = PEEK(0);
+			WRITE_BARRIER(PEEK(0));
+			DISPATCH();
+		}
+		CASE(OP_GET_GLOBAL): {
+			uint16_t slot = READ_SHORT();
+			Value value = vm.global_values.values[slot];
+			if (IS_UNDEFINED(value)) {
+				RUNTIME_ERROR("undefined variable '%s'.",
+					AS_STRING(vm.global_names.values[slot])->str);
 			}
-			PushStack(value);
-			break;
-		}
-		case OP_SET_GLOBAL: {
-			ObjString* name = READ_STRING();
-			if (TableSet(&vm.globals, name, PeekStack(0))) {
-				TableDelete(&vm.globals, name);
-				RuntimeError("undefined variable '%s'.", name->str);
-				return INTERPRET_RUNTIME_ERROR;
+			PUSH(value);
+			DISPATCH();
+		}
+		CASE(OP_SET_GLOBAL): {
+			uint16_t slot = READ_SHORT();
+			if (IS_UNDEFINED(vm.global_values.values[slot])) {
+				RUNTIME_ERROR("undefined variable '%s'.",
+					AS_STRING(vm.global_names.values[slot])->str);
 			}
-			break;
+			vm.global_values.values[slot] = PEEK(0);
+			DISPATCH();
 		}
-		case OP_CONSTANT: {
+		CASE(OP_CONSTANT): {
 			Value constant = READ_CONSTANT();
-			PushStack(constant);
-			break;
-		}
-		case OP_NIL: PushStack(NIL_VAL); break;
-		case OP_TRUE: PushStack(BOOL_VAL(true)); break;
-		case OP_FALSE: PushStack(BOOL_VAL(false)); break;
-		case OP_NOT: PushStack(BOOL_VAL(IsFalsey(PopStack()))); break;
-		case OP_NEGATE: {
-			if (!IS_NUMBER(PeekStack(0))) {
-				RuntimeError("operand must be number.");
-				return INTERPRET_RUNTIME_ERROR;
+			PUSH(constant);
+			DISPATCH();
+		}
+		CASE(OP_NIL): PUSH(NIL_VAL); DISPATCH();
+		CASE(OP_TRUE): PUSH(BOOL_VAL(true)); DISPATCH();
+		CASE(OP_FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+		CASE(OP_NOT): PEEK(0) = BOOL_VAL(IsFalsey(PEEK(0))); DISPATCH();
+		CASE(OP_NEGATE): {
+			if (!IS_NUMBER(PEEK(0))) {
+				RUNTIME_ERROR("operand must be number.");
 			}
-			PushStack(NUMBER_VAL(-AS_NUMBER(PopStack())));
-			break;
+			PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+			DISPATCH();
 		}
-		case OP_EQUAL: {
-			Value b = PopStack();
-			Value a = PopStack();
-			PushStack(BOOL_VAL(ValuesEqual(a, b)));
-			break;
+		CASE(OP_EQUAL): {
+			Value b = POP();
+			Value a = POP();
+			PUSH(BOOL_VAL(ValuesEqual(a, b)));
+			DISPATCH();
 		}
-		case OP_GREATER: {
+		CASE(OP_GREATER): {
 			BINARY_OP(BOOL_VAL, >);
-			break;
+			DISPATCH();
 		}
-		case OP_LESS: {
+		CASE(OP_LESS): {
 			BINARY_OP(BOOL_VAL, <);
-			break;
+			DISPATCH();
 		}
-		case OP_ADD: {
-			if (IS_STRING(PeekStack(0)) && IS_STRING(PeekStack(1))) {
-				Concatenate();
+		CASE(OP_ADD): {
+			if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+				double b = AS_NUMBER(POP());
+				double a = AS_NUMBER(POP());
+				PUSH(NUMBER_VAL(a + b));
 			}
-			else if (IS_NUMBER(PeekStack(0)) && IS_NUMBER(PeekStack(1))) {
-				double b = AS_NUMBER(PopStack());
-				double a = AS_NUMBER(PopStack());
-				PushStack(NUMBER_VAL(a + b));
+			else if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+				STORE_FRAME();
+				Concatenate();
+				stack_top = vm.stack_top;
 			}
 			else {
-				RuntimeError("operands must be two strings or two numbers.");
-				return INTERPRET_RUNTIME_ERROR;
+				RUNTIME_ERROR("operands must be two strings or two numbers.");
 			}
 			//BINARY_OP(NUMBER_VAL, +);
-			break;
+			DISPATCH();
 		}
-		case OP_SUBTRACT: {
+		CASE(OP_SUBTRACT): {
 			BINARY_OP(NUMBER_VAL, -);
-			break;
+			DISPATCH();
 		}
-		case OP_MULTIPLY: {
+		CASE(OP_MULTIPLY): {
 			BINARY_OP(NUMBER_VAL, *);
-			break;
+			DISPATCH();
 		}
-		case OP_DIVIDE: {
+		CASE(OP_DIVIDE): {
 			BINARY_OP(NUMBER_VAL, / );
-			break;
+			DISPATCH();
+		}
+		CASE(OP_ADD_CONSTANT): {
+			Value b = READ_CONSTANT();
+			if (IS_NUMBER(PEEK(0)) && IS_NUMBER(b)) {
+				PEEK(0) = NUMBER_VAL(AS_NUMBER(PEEK(0)) + AS_NUMBER(b));
+			}
+			else if (IS_STRING(PEEK(0)) && IS_STRING(b)) {
+				PUSH(b);
+				STORE_FRAME();
+				Concatenate();
+				stack_top = vm.stack_top;
+			}
+			else {
+				RUNTIME_ERROR("operands must be two strings or two numbers.");
+			}
+			DISPATCH();
+		}
+		CASE(OP_SUBTRACT_CONSTANT): {
+			BINARY_OP_CONSTANT(NUMBER_VAL, -);
+			DISPATCH();
+		}
+		CASE(OP_LESS_CONSTANT): {
+			BINARY_OP_CONSTANT(BOOL_VAL, <);
+			DISPATCH();
+		}
+		CASE(OP_SET_LOCAL_POP): {
+			uint8_t slot = READ_BYTE();
+			slots[slot] = POP();
+			DISPATCH();
+		}
+		CASE(OP_ADD_LOCALS): {
+			Value a = slots[READ_BYTE()];
+			Value b = slots[READ_BYTE()];
+			if (IS_NUMBER(a) && IS_NUMBER(b)) {
+				PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+			}
+			else if (IS_STRING(a) && IS_STRING(b)) {
+				PUSH(a);
+				PUSH(b);
+				STORE_FRAME();
+				Concatenate();
+				stack_top = vm.stack_top;
+			}
+			else {
+				RUNTIME_ERROR("operands must be two strings or two numbers.");
+			}
+			DISPATCH();
+		}
+		CASE(OP_JUMP_IF_LESS): {
+			COMPARE_JUMP(<, true);
+			DISPATCH();
+		}
+		CASE(OP_JUMP_IF_NOT_LESS): {
+			COMPARE_JUMP(<, false);
+			DISPATCH();
+		}
+		CASE(OP_JUMP_IF_GREATER): {
+			COMPARE_JUMP(>, true);
+			DISPATCH();
+		}
+		CASE(OP_JUMP_IF_NOT_GREATER): {
+			COMPARE_JUMP(>, false);
+			DISPATCH();
+		}
+		CASE(OP_JUMP_IF_EQUAL): {
+			uint16_t offset = READ_SHORT();
+			Value b = POP();
+			Value a = POP();
+			if (ValuesEqual(a, b)) ip += offset;
+			DISPATCH();
+		}
+		CASE(OP_JUMP_IF_NOT_EQUAL): {
+			uint16_t offset = READ_SHORT();
+			Value b = POP();
+			Value a = POP();
+			if (!ValuesEqual(a, b)) ip += offset;
+			DISPATCH();
+		}
+		CASE(OP_POP_JUMP_IF_FALSE): {
+			uint16_t offset = READ_SHORT();
+			if (IsFalsey(POP())) ip += offset;
+			DISPATCH();
+		}
+		CASE(OP_POP_JUMP_IF_TRUE): {
+			uint16_t offset = READ_SHORT();
+			if (!IsFalsey(POP())) ip += offset;
+			DISPATCH();
 		}
 
 		default:
-			break;
+#ifdef COMPUTED_GOTO
+		DO_UNKNOWN:
+#endif // COMPUTED_GOTO
+			DISPATCH();
 		}
 	}
 
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
 #undef READ_BYTE
 #undef READ_CONSTANT
-#undef READ_STRING
 #undef READ_SHORT
+#undef PUSH
+#undef POP
+#undef PEEK
 #undef BINARY_OP
+#undef COMPARE_JUMP
+#undef BINARY_OP_CONSTANT
+#undef CASE
+#undef DISPATCH
 }
\ No newline at end of file
@@ -1,12 +1,25 @@
 #ifndef CLOX_VM_H
 #define CLOX_VM_H
 
+#include <stdio.h>
+
 #include "chunk.h"
 #include "table.h"
 #include "object.h"
 
-#define FRAME_MAX 64
+// the frame and value stacks start small and grow on demand up to
+// vm.frame_max and vm.stack_max, which default to these caps.
+#ifndef FRAME_MAX
+#define FRAME_MAX 4096
+#endif // !FRAME_MAX
 #define STACK_MAX (FRAME_MAX * UINT8_COUNT)
+#define FRAMES_INITIAL 8
+#define STACK_INITIAL 256
+// room for the values helpers such as AllocateString() push to keep
+// objects reachable, on top of what a function itself needs.
+#define STACK_RESERVE 8
+#define GC_PAUSE_BUCKETS 32
+#define GC_PAUSE_BUDGET_NS (500 * 1000)
 
 typedef struct {
 	ObjClosure* closure;
@@ -14,15 +27,56 @@ typedef struct {
 	Value* slots;
 } CallFrame;
 
+typedef enum {
+	GC_PHASE_IDLE,
+	GC_PHASE_MARK,
+	GC_PHASE_SWEEP,
+} GcPhase;
+
+// bucket i counts pauses shorter than 2^i microseconds
+// that did not fit in bucket i - 1.
 typedef struct {
-	CallFrame frames[FRAME_MAX];
+	uint64_t buckets[GC_PAUSE_BUCKETS];
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+} GcPauses;
+
+typedef struct {
+	CallFrame* frames;
 	int frame_count;
-	Value stack[STACK_MAX];
+	int frame_capacity;
+	int frame_max;
+	Value* stack;
 	Value* stack_top;
-	Table globals;
+	int stack_capacity;
+	int stack_max;
+	// global names resolve at compile time to indices into
+	// global_values; undefined slots hold UNDEFINED_VAL.
+	Table global_slots;
+	ValueArray global_values;
+	ValueArray global_names;
 	Table strings;
 	Obj* obj_head;
-	ObjUpvalue* open_upvalues;
+	// open_upvalues[i] is the open upvalue over stack slot i, or NULL.
+	// it grows with the stack, and no slot at or above
+	// open_upvalue_top has one.
+	ObjUpvalue** open_upvalues;
+	int open_upvalue_top;
+
+	size_t bytes_allocated;
+	size_t next_gc;
+	int gray_count;
+	int gray_capacity;
+	Obj** gray_stack;
+
+	GcPhase gc_phase;
+	size_t gc_debt;
+	uint64_t gc_pause_budget;
+	Obj* sweep_list;
+	// flipped as each sweep starts, see Obj.swept.
+	bool swept;
+	GcPauses gc_pauses;
 } VM;
 
 typedef enum {
@@ -36,8 +90,11 @@ extern VM vm;
 void InitVM();
 void FreeVM();
 //InterpretResult Interpret(Chunk* chunk);
-InterpretResult Interpret(const char* source);
+InterpretResult Interpret(const char* source, size_t length);
+InterpretResult InterpretFunction(ObjFunction* function);
+InterpretResult InterpretStream(FILE* stream);
 void PushStack(Value value);
 Value PopStack();
+int ResolveGlobal(ObjString* name);
 
 #endif // !CLOX_VM_H